@@ -8,11 +8,48 @@
 #include <optional>
 #include <cstdint>
 #include <algorithm>
+#include <string>
+#include <chrono>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdarg>
+#include <cctype>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <fstream>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include <utility>
+#include <atomic>
+#include <iterator>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 // 1.4 - We are going to use an optional value
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
 
+// 39 - How many frames the CPU is allowed to get ahead of the GPU.
+// 2 lets us record frame N+1 while the GPU is still busy with frame N.
+const uint32_t DEFAULT_FRAMES_IN_FLIGHT = 2;
+
+// 59 - While the user drags the window border we get a resize event per mouse
+// move. Only rebuild the swap chain once the size stopped changing this long.
+const std::chrono::milliseconds RESIZE_DEBOUNCE(100);
+
 // Validation layers
 // Vulkan can configure the validation layers in which it needs to work.
 // Validate errors.
@@ -20,9 +57,96 @@ const uint32_t HEIGHT = 600;
 const std::vector<const char *> validationLayers = {"VK_LAYER_KHRONOS_validation"};
 
 // 23 - Add an extension layer.
-const std::vector<const char *> deviceExtensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+// 99 - Every device extension we know about, in two tiers. Required ones decide
+// whether a device can run us at all, optional ones are enabled whenever the
+// device has them. The order here is the order of deviceExtensionInfos.
+enum class DeviceExtension : uint32_t
+{
+    Swapchain,
+    MemoryBudget,
+    PipelineCreationCacheControl,
+    Maintenance4,
+    TimelineSemaphore,
+    Synchronization2,
+    DynamicRendering,
+    PresentId,
+    PresentWait,
+    ImageFormatList,
+    SwapchainMutableFormat,
+    Count
+};
+
+struct DeviceExtensionInfo
+{
+    const char *name;
+    bool required;
+    // Only makes sense when we present to a surface.
+    bool presentOnly;
+    // Core since this version, then the extension isn't enabled (0 if never).
+    uint32_t promotedIn;
+    // Its own dependencies are only core since this version.
+    uint32_t minApiVersion;
+};
+
+const DeviceExtensionInfo deviceExtensionInfos[] = {
+    {VK_KHR_SWAPCHAIN_EXTENSION_NAME, true, true, 0, VK_API_VERSION_1_0},
+    {VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, false, false, 0, VK_API_VERSION_1_1},
+    {VK_EXT_PIPELINE_CREATION_CACHE_CONTROL_EXTENSION_NAME, false, false, VK_API_VERSION_1_3, VK_API_VERSION_1_0},
+    {VK_KHR_MAINTENANCE_4_EXTENSION_NAME, false, false, VK_API_VERSION_1_3, VK_API_VERSION_1_1},
+    {VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME, false, false, VK_API_VERSION_1_2, VK_API_VERSION_1_1},
+    {VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME, false, false, VK_API_VERSION_1_3, VK_API_VERSION_1_1},
+    {VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME, false, false, VK_API_VERSION_1_3, VK_API_VERSION_1_2},
+    {VK_KHR_PRESENT_ID_EXTENSION_NAME, false, true, 0, VK_API_VERSION_1_1},
+    {VK_KHR_PRESENT_WAIT_EXTENSION_NAME, false, true, 0, VK_API_VERSION_1_1},
+    {VK_KHR_IMAGE_FORMAT_LIST_EXTENSION_NAME, false, false, VK_API_VERSION_1_2, VK_API_VERSION_1_0},
+    {VK_KHR_SWAPCHAIN_MUTABLE_FORMAT_EXTENSION_NAME, false, true, 0, VK_API_VERSION_1_1},
+};
+static_assert(std::size(deviceExtensionInfos) == static_cast<size_t>(DeviceExtension::Count),
+              "deviceExtensionInfos must have one entry per DeviceExtension");
+
+// A set of extensions as one integer, cheap enough to test in hot paths.
+class DeviceExtensionSet
+{
+public:
+    bool has(DeviceExtension extension) const
+    {
+        return (bits >> static_cast<uint32_t>(extension)) & 1u;
+    }
+
+    void add(DeviceExtension extension)
+    {
+        bits |= uint64_t(1) << static_cast<uint32_t>(extension);
+    }
+
+    void add(const DeviceExtensionSet &other)
+    {
+        bits |= other.bits;
+    }
+
+    bool containsAll(const DeviceExtensionSet &other) const
+    {
+        return (bits & other.bits) == other.bits;
+    }
+
+    std::vector<const char *> names() const
+    {
+        std::vector<const char *> result;
+        for (uint32_t i = 0; i < static_cast<uint32_t>(DeviceExtension::Count); i++)
+        {
+            if (has(static_cast<DeviceExtension>(i)))
+            {
+                result.push_back(deviceExtensionInfos[i].name);
+            }
+        }
+        return result;
+    }
 
-// Leaving the possibility to remove validation layers.
+private:
+    uint64_t bits = 0;
+};
+
+// Leaving the possibility to remove validation layers. Only the default,
+// see AppConfig::validation to switch them at runtime.
 #ifdef NDEBUG
 const bool enableValidationLayers = false;
 #else
@@ -31,201 +155,5569 @@ const bool enableValidationLayers = true;
 
 namespace biniutils
 {
-    void logstdout(const char *msg)
+    // 90 - How important a message is, messages under the logger's level are dropped.
+    enum class LogLevel
     {
-        std::cout << msg << std::endl;
-    }
-}
+        Debug,
+        Info,
+        Warning,
+        Error
+    };
 
-// 1.6 - We are going to create an struct that contains
-struct QueueFamilyIndexes
-{
-    std::optional<uint32_t> graphicsFamily;
+    // What part of the app a message comes from.
+    enum class LogCategory
+    {
+        General,
+        Device,
+        SwapChain,
+        Memory,
+        Render,
+        Profiler,
+        Validation
+    };
 
-    // 18 - Add a second index for the presentation queue family.
-    std::optional<uint32_t> presentFamily;
+// Categories compiled in, one bit per LogCategory. Messages of the others
+// are removed by the compiler, their arguments aren't even built.
+#ifndef LOG_CATEGORIES
+#define LOG_CATEGORIES 0xFFFFFFFFu
+#endif
 
-    // 1.7 Convienience method to verify that they have value
-    bool isComplete()
+    // 91 - Logging without blocking the caller. Messages go into a fixed
+    // ring (bounded lock-free queue, many producers and one consumer) that a
+    // background thread writes out, so a call costs a copy and an atomic
+    // instead of a write and a flush. logf() formats straight into the ring,
+    // no heap allocation at all. When the ring is full messages are dropped
+    // and counted, the render thread never waits for the terminal.
+    class Logger
     {
-        return graphicsFamily.has_value() && presentFamily.has_value();
-    }
-};
+    public:
+        static constexpr size_t CAPACITY = 1024;
+        static constexpr size_t MAX_MESSAGE = 1000;
 
-// 25 - We need to do more than just check for chain swap support.
-// We need to setup the chain swap and save several references that will
-// be used later.
-struct SwapChainSupportDetails
-{
-    VkSurfaceCapabilitiesKHR capabilities;
-    std::vector<VkSurfaceFormatKHR> formats;
-    std::vector<VkPresentModeKHR> presentModes;
-};
+        static Logger &instance()
+        {
+            static Logger logger;
+            return logger;
+        }
 
-// how to define a class in C++
-// can be done in a single file
-// can be separated in header + definition
-class FirstVulkanExample
-{
-    // in a c++ class we classify first by access modifier
-public:
-    void run()
-    {
-        // fun stuff here later!
-        initWindow();
-        initVulkan();
-        mainLoop();
-        cleanup();
-    }
+        void setLevel(LogLevel level)
+        {
+            minLevel.store(level, std::memory_order_relaxed);
+        }
 
-private:
-    // We can declare attributes here.
-    // The first thing is the window object.
-    GLFWwindow *window;
+        bool accepts(LogLevel level) const
+        {
+            return level >= minLevel.load(std::memory_order_relaxed);
+        }
 
-    // Need to create a Vulkan instance.
-    VkInstance instance;
+        void log(LogLevel level, LogCategory category, const char *message)
+        {
+            size_t position;
+            Cell *cell = claim(level, category, position);
+            if (cell == nullptr)
+            {
+                return;
+            }
+            size_t length = std::strlen(message);
+            if (length > MAX_MESSAGE - 1)
+            {
+                length = MAX_MESSAGE - 1;
+            }
+            std::memcpy(cell->entry.text, message, length);
+            cell->entry.text[length] = '\0';
+            cell->sequence.store(position + 1, std::memory_order_release);
+        }
 
-    // 1.2 - We need an instance that saves the reference of the physical device
-    // used by Vulkan.
-    // Important: This reference is cleanup when destroying Vulkan instance.
-    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+        // printf style, formatted right into the ring cell.
+        void logf(LogLevel level, LogCategory category, const char *format, ...)
+        {
+            size_t position;
+            Cell *cell = claim(level, category, position);
+            if (cell == nullptr)
+            {
+                return;
+            }
+            va_list arguments;
+            va_start(arguments, format);
+            // Truncates long messages, always terminates.
+            std::vsnprintf(cell->entry.text, MAX_MESSAGE, format, arguments);
+            va_end(arguments);
+            cell->sequence.store(position + 1, std::memory_order_release);
+        }
 
-    // 1.8 - Add logical device - It can be n by physical device.
-    VkDevice device;
+        // Wait until everything logged so far was written. Before exiting or
+        // printing something ourselves.
+        void flush()
+        {
+            size_t target = enqueuePosition.load(std::memory_order_relaxed);
+            std::unique_lock<std::mutex> lock(flushMutex);
+            flushed.wait(lock, [this, target]
+                         { return written.load(std::memory_order_acquire) >= target || !running.load(std::memory_order_relaxed); });
+        }
 
-    // When logical device is created a graphics queue is created.
-    VkQueue graphicsQueue;
+    private:
+        struct Entry
+        {
+            LogLevel level;
+            LogCategory category;
+            uint32_t thread;
+            std::chrono::steady_clock::time_point time;
+            char text[MAX_MESSAGE];
+        };
 
-    // 13 - Create the surface
-    // Surface - Space where the render will be presented.
-    VkSurfaceKHR surface;
+        struct Cell
+        {
+            std::atomic<size_t> sequence{0};
+            Entry entry;
+        };
 
-    // 17 - Add a reference to work with the presentation queue.
-    VkQueue presentQueue;
+        std::vector<Cell> cells = std::vector<Cell>(CAPACITY);
+        std::atomic<size_t> enqueuePosition{0};
+        // Only the writer thread touches this one.
+        size_t dequeuePosition = 0;
+        std::atomic<size_t> written{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<LogLevel> minLevel{LogLevel::Info};
+        std::atomic<bool> running{true};
+        // The writer signals it after every batch, flush() waits on it.
+        std::mutex flushMutex;
+        std::condition_variable flushed;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::thread writer;
 
-    // 33 - Create an instance to save our newly created swap chain.
-    VkSwapchainKHR swapChain;
+        Logger()
+        {
+            for (size_t i = 0; i < CAPACITY; i++)
+            {
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+            writer = std::thread(&Logger::writerLoop, this);
+        }
 
-    // 35 - Declare the images that will be used by the swap chain.
-    std::vector<VkImage> swapChainImages;
+        ~Logger()
+        {
+            running.store(false, std::memory_order_relaxed);
+            writer.join();
+            notifyFlushed();
+        }
 
-    // 37 - Save the reference to the format and extent that we got as result
-    VkFormat swapChainImageFormat;
-    VkExtent2D swapChainExtent;
+        // Claims a cell and fills everything but the text, nullptr when the
+        // level is off or the ring is full. The caller writes the text and
+        // publishes the cell by storing position + 1 in its sequence.
+        Cell *claim(LogLevel level, LogCategory category, size_t &position)
+        {
+            if (!accepts(level))
+            {
+                return nullptr;
+            }
+            // Its sequence equals our position when the cell is free.
+            position = enqueuePosition.load(std::memory_order_relaxed);
+            Cell *cell;
+            while (true)
+            {
+                cell = &cells[position % CAPACITY];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+                if (difference == 0)
+                {
+                    if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (difference < 0)
+                {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return nullptr;
+                }
+                else
+                {
+                    position = enqueuePosition.load(std::memory_order_relaxed);
+                }
+            }
 
-    void initWindow()
-    {
-        glfwInit();
-        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-        glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+            Entry &entry = cell->entry;
+            entry.level = level;
+            entry.category = category;
+            entry.thread = threadId();
+            entry.time = std::chrono::steady_clock::now();
+            return cell;
+        }
 
-        window = glfwCreateWindow(WIDTH, HEIGHT, "Test Window", nullptr, nullptr);
-    }
+        // Taking the lock between updating written and notifying means a
+        // flush() that just checked can't miss the wake up.
+        void notifyFlushed()
+        {
+            {
+                std::lock_guard<std::mutex> lock(flushMutex);
+            }
+            flushed.notify_all();
+        }
 
-    void initVulkan()
-    {
-        // First we need to check validation layers
-        if (enableValidationLayers && !checkValidationLayerSupport())
+        // Small numbers are easier to read than std::thread::id, 0 is the
+        // first thread that logs (the main thread).
+        static uint32_t threadId()
         {
-            biniutils::logstdout("Oh no! No support :(");
-            throw std::runtime_error("Validation layers requested are not available with this system!");
+            static std::atomic<uint32_t> nextId{0};
+            thread_local uint32_t id = nextId.fetch_add(1, std::memory_order_relaxed);
+            return id;
         }
-        // Process of vulkan setup
-        createVulkanInstance();
 
-        // 14 - Create the surface
-        createSurface();
+        static const char *levelName(LogLevel level)
+        {
+            switch (level)
+            {
+            case LogLevel::Debug:
+                return "debug";
+            case LogLevel::Info:
+                return "info";
+            case LogLevel::Warning:
+                return "warning";
+            case LogLevel::Error:
+                return "error";
+            }
+            return "?";
+        }
 
-        // 1 - Once the instance is created we need to select a physical device to interact with
-        pickPhysicalDevice();
-        biniutils::logstdout("Physical device being used.");
+        static const char *categoryName(LogCategory category)
+        {
+            switch (category)
+            {
+            case LogCategory::General:
+                return "general";
+            case LogCategory::Device:
+                return "device";
+            case LogCategory::SwapChain:
+                return "swapchain";
+            case LogCategory::Memory:
+                return "memory";
+            case LogCategory::Render:
+                return "render";
+            case LogCategory::Profiler:
+                return "profiler";
+            case LogCategory::Validation:
+                return "validation";
+            }
+            return "?";
+        }
 
-        // 31 - Method to create the swap chain
-        createSwapChain();
+        // Write everything there is, one flush per batch, then nap. Keeps
+        // going until the queue is empty after the logger was stopped.
+        void writerLoop()
+        {
+            char prefix[96];
+            while (true)
+            {
+                bool wroteSomething = false;
+                while (true)
+                {
+                    Cell &cell = cells[dequeuePosition % CAPACITY];
+                    if (cell.sequence.load(std::memory_order_acquire) != dequeuePosition + 1)
+                    {
+                        break;
+                    }
+                    const Entry &entry = cell.entry;
+                    double seconds = std::chrono::duration<double>(entry.time - start).count();
+                    std::snprintf(prefix, sizeof(prefix), "[%10.4f] [%s] [%s] [thread %u] ", seconds, levelName(entry.level),
+                                  categoryName(entry.category), entry.thread);
+                    (entry.level >= LogLevel::Warning ? std::cerr : std::cout) << prefix << entry.text << '\n';
+                    cell.sequence.store(dequeuePosition + CAPACITY, std::memory_order_release);
+                    dequeuePosition++;
+                    written.store(dequeuePosition, std::memory_order_release);
+                    wroteSomething = true;
+                }
 
-        // 9 - Once physical device is validated create logical devices.
-        createLogicalDevice();
+                uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+                if (lost > 0)
+                {
+                    std::cerr << "[logger] " << lost << " message(s) dropped, the log queue was full\n";
+                }
+                if (wroteSomething || lost > 0)
+                {
+                    std::cout.flush();
+                    notifyFlushed();
+                }
+                else if (!running.load(std::memory_order_relaxed))
+                {
+                    return;
+                }
+                else
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+        }
+    };
 
-        // 11 - Create surface where we are going to be drawing.
-        // We are going to use a Vulkan Extension - VK_KHR_surface para interactuar con una ventana.
-        // VkSurfaceKHR surface;
+    constexpr bool categoryEnabled(LogCategory category)
+    {
+        return ((LOG_CATEGORIES >> static_cast<uint32_t>(category)) & 1u) != 0;
     }
 
-    void createSwapChain()
+    // General information, what every message used to be.
+    void logstdout(const char *msg)
     {
-        SwapChainSupportDetails swapChainSupport = querySwapChainSupport(physicalDevice);
-
-        // Retrieve the 3 values we just made methods for.
-        VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);
-        VkPresentModeKHR presentMode = chooseSwapPresentMode(swapChainSupport.presentModes);
-        VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
+        Logger::instance().log(LogLevel::Info, LogCategory::General, msg);
+    }
 
-        // Establish the minimum amount of images within the swap chain.
-        uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
+    void logstdout(const std::string &msg)
+    {
+        logstdout(msg.c_str());
+    }
 
-        // Setup max images.
-        if (swapChainSupport.capabilities.maxImageCount > 0 && imageCount > swapChainSupport.capabilities.maxImageCount)
+    // "a,b,c" into its parts, for options that take a list.
+    std::vector<std::string> splitList(const std::string &text)
+    {
+        std::vector<std::string> parts;
+        size_t start = 0;
+        while (start <= text.size())
         {
-            imageCount = swapChainSupport.capabilities.maxImageCount;
+            size_t end = text.find(',', start);
+            if (end == std::string::npos)
+            {
+                end = text.size();
+            }
+            parts.push_back(text.substr(start, end - start));
+            start = end + 1;
         }
+        return parts;
+    }
 
-        VkSwapchainCreateInfoKHR createInfo{};
-        createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
-        createInfo.surface = surface;
-        createInfo.minImageCount = imageCount;
-        createInfo.imageFormat = surfaceFormat.format;
-        createInfo.imageColorSpace = surfaceFormat.colorSpace;
-        createInfo.imageExtent = extent;
-        createInfo.imageArrayLayers = 1;
-        createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-        createInfo.presentMode = presentMode;
-
-        // Get queue families and determine ownership of images in the swap chain.
-        QueueFamilyIndexes indices = findQueueFamilies(physicalDevice);
-        uint32_t queueFamilyIndices[] = {indices.graphicsFamily.value(), indices.presentFamily.value()};
+    // Makes sure what was written to the file is on the disk, not only in the
+    // OS cache, so a power loss can't leave it half written.
+    bool syncFile(FILE *file)
+    {
+#ifdef _WIN32
+        return _commit(_fileno(file)) == 0;
+#else
+        return fsync(fileno(file)) == 0;
+#endif
+    }
 
-        // 2 possibilities, they are the same family, or not.
-        if (indices.graphicsFamily != indices.presentFamily)
+    // Same for the directory entry of a file that was just renamed into it.
+    // Windows has no equivalent, the rename is journaled with the file.
+    void syncDirectoryOf(const std::string &path)
+    {
+#ifndef _WIN32
+        size_t slash = path.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+        int fd = open(directory.c_str(), O_RDONLY);
+        if (fd >= 0)
         {
-            createInfo.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
-            createInfo.queueFamilyIndexCount = 2;
-            createInfo.pQueueFamilyIndices = queueFamilyIndices;
+            fsync(fd);
+            close(fd);
         }
-        else
+#else
+        (void)path;
+#endif
+    }
+
+    // Puts from in place of to in one step, replacing it if it exists.
+    // rename() does that on POSIX but fails on Windows when to exists.
+    bool replaceFile(const std::string &from, const std::string &to)
+    {
+#ifdef _WIN32
+        return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+        return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+    }
+
+    std::string toLower(std::string text)
+    {
+        std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c)
+                       { return static_cast<char>(std::tolower(c)); });
+        return text;
+    }
+
+    // Same 8-4-4-4-12 layout tools like nvidia-smi or vulkaninfo print.
+    std::string uuidToString(const uint8_t *uuid)
+    {
+        std::string result;
+        char hex[3];
+        for (uint32_t i = 0; i < VK_UUID_SIZE; i++)
         {
-            createInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
-            createInfo.queueFamilyIndexCount = 0;     // Optional
-            createInfo.pQueueFamilyIndices = nullptr; // Optional
+            if (i == 4 || i == 6 || i == 8 || i == 10)
+            {
+                result += '-';
+            }
+            std::snprintf(hex, sizeof(hex), "%02x", uuid[i]);
+            result += hex;
         }
+        return result;
+    }
+}
 
-        // Apply transformation already done to the world.
-        createInfo.preTransform = swapChainSupport.capabilities.currentTransform;
+// Log with a level and category, BINI_LOG(Warning, SwapChain, "text"). The
+// message is only built when the category is compiled in and the level is on.
+// Building it allocates a std::string, fine for setup and rare events. Code
+// that runs every frame uses BINI_LOGF, formatted straight into the ring.
+#define BINI_LOG(level, category, message)                                                      \
+    do                                                                                          \
+    {                                                                                           \
+        if constexpr (biniutils::categoryEnabled(biniutils::LogCategory::category))             \
+        {                                                                                       \
+            biniutils::Logger &biniLogger = biniutils::Logger::instance();                      \
+            if (biniLogger.accepts(biniutils::LogLevel::level))                                 \
+            {                                                                                   \
+                biniLogger.log(biniutils::LogLevel::level, biniutils::LogCategory::category,    \
+                               std::string(message).c_str());                                   \
+            }                                                                                   \
+        }                                                                                       \
+    } while (0)
 
-        // Is there a need to blend?
-        createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+// printf style, BINI_LOGF(Info, Render, "%u draws", count). No allocation.
+#define BINI_LOGF(level, category, ...)                                                                                 \
+    do                                                                                                                  \
+    {                                                                                                                   \
+        if constexpr (biniutils::categoryEnabled(biniutils::LogCategory::category))                                     \
+        {                                                                                                               \
+            biniutils::Logger::instance().logf(biniutils::LogLevel::level, biniutils::LogCategory::category, __VA_ARGS__); \
+        }                                                                                                               \
+    } while (0)
 
-        createInfo.presentMode = presentMode;
-        createInfo.clipped = VK_TRUE;
-        createInfo.oldSwapchain = VK_NULL_HANDLE;
+// 89 - Scoped zones to see where the CPU time goes. Every thread writes into
+// its own ring buffer, so recording a zone takes no lock: two clock reads and
+// a store. Off until enabled, then a zone costs one atomic load. Build with
+// -DENABLE_CPU_PROFILER=0 to remove the zones completely.
+#ifndef ENABLE_CPU_PROFILER
+#define ENABLE_CPU_PROFILER 1
+#endif
+
+class CpuProfiler
+{
+public:
+    // Zones kept per thread, older ones are overwritten.
+    static constexpr size_t EVENTS_PER_THREAD = 1 << 16;
+
+    static CpuProfiler &instance()
+    {
+        static CpuProfiler profiler;
+        return profiler;
+    }
+
+    void enable()
+    {
+        active.store(true, std::memory_order_relaxed);
+    }
+
+    bool enabled() const
+    {
+        return active.load(std::memory_order_relaxed);
+    }
+
+    // Nanoseconds since the profiler was created.
+    uint64_t now() const
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count());
+    }
+
+    // Name has to outlive the profiler, zones are named with string literals.
+    void record(const char *name, uint64_t start, uint64_t end)
+    {
+        ThreadBuffer &buffer = threadBuffer();
+        buffer.events[buffer.written % EVENTS_PER_THREAD] = {name, start, end};
+        buffer.written++;
+    }
+
+    // Chrome trace event format, opens in chrome://tracing and Perfetto.
+    // Call when no other thread is recording anymore.
+    void writeChromeTrace(const std::string &path)
+    {
+        std::ofstream file(path);
+        if (!file)
+        {
+            BINI_LOG(Warning, Profiler, "Couldn't write the CPU trace to " + path);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(registryMutex);
+        file << "{\"traceEvents\":[\n";
+        bool first = true;
+        char line[256];
+        for (const auto &buffer : buffers)
+        {
+            std::snprintf(line, sizeof(line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                          first ? "" : ",\n", buffer->threadIndex, buffer->threadIndex == 0 ? "main" : "worker");
+            file << line;
+            first = false;
+
+            uint64_t count = std::min<uint64_t>(buffer->written, EVENTS_PER_THREAD);
+            for (uint64_t i = buffer->written - count; i < buffer->written; i++)
+            {
+                const Event &event = buffer->events[i % EVENTS_PER_THREAD];
+                std::snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                              event.name, buffer->threadIndex, event.start / 1000.0, (event.end - event.start) / 1000.0);
+                file << line;
+            }
+        }
+        file << "\n]}\n";
+        BINI_LOG(Info, Profiler, "CPU trace written to " + path);
+    }
+
+private:
+    struct Event
+    {
+        const char *name;
+        uint64_t start;
+        uint64_t end;
+    };
+
+    struct ThreadBuffer
+    {
+        uint32_t threadIndex = 0;
+        std::vector<Event> events = std::vector<Event>(EVENTS_PER_THREAD);
+        uint64_t written = 0;
+    };
+
+    std::atomic<bool> active{false};
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+    // Buffers of every thread that recorded something, kept after the
+    // thread ends so its zones still make it into the trace.
+    std::mutex registryMutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+
+    // Only the first zone of a thread takes the lock.
+    ThreadBuffer &threadBuffer()
+    {
+        thread_local std::shared_ptr<ThreadBuffer> buffer;
+        if (!buffer)
+        {
+            buffer = std::make_shared<ThreadBuffer>();
+            std::lock_guard<std::mutex> lock(registryMutex);
+            buffer->threadIndex = static_cast<uint32_t>(buffers.size());
+            buffers.push_back(buffer);
+        }
+        return *buffer;
+    }
+};
+
+// Records the time between its construction and the end of the scope.
+class CpuZone
+{
+public:
+    explicit CpuZone(const char *name) : name(name)
+    {
+        if (CpuProfiler::instance().enabled())
+        {
+            start = CpuProfiler::instance().now();
+            recording = true;
+        }
+    }
+
+    ~CpuZone()
+    {
+        if (recording)
+        {
+            CpuProfiler &profiler = CpuProfiler::instance();
+            profiler.record(name, start, profiler.now());
+        }
+    }
+
+private:
+    const char *name;
+    uint64_t start = 0;
+    bool recording = false;
+};
+
+#if ENABLE_CPU_PROFILER
+#define CPU_ZONE_CONCAT_INNER(a, b) a##b
+#define CPU_ZONE_CONCAT(a, b) CPU_ZONE_CONCAT_INNER(a, b)
+#define CPU_ZONE(name) CpuZone CPU_ZONE_CONCAT(cpuZone, __LINE__)(name)
+#else
+#define CPU_ZONE(name)
+#endif
+
+// 63 - What the application wants from presentation. Each policy maps to the
+// best present mode the surface supports, see chooseSwapPresentMode.
+enum class PresentPolicy
+{
+    // Show frames as soon as they are ready, tearing is acceptable.
+    LowestLatency,
+    // Wait for vertical blank, the GPU idles when it's ahead.
+    PowerSaving,
+    // Render as fast as possible but only show complete frames.
+    TearFreeThroughput,
+    // Never block on the display, for measuring frames per second.
+    UncappedBenchmark,
+};
+
+const char *presentPolicyName(PresentPolicy policy)
+{
+    switch (policy)
+    {
+    case PresentPolicy::LowestLatency:
+        return "latency";
+    case PresentPolicy::PowerSaving:
+        return "power";
+    case PresentPolicy::TearFreeThroughput:
+        return "tearfree";
+    case PresentPolicy::UncappedBenchmark:
+        return "benchmark";
+    }
+    return "unknown";
+}
+
+const char *presentModeName(VkPresentModeKHR mode)
+{
+    switch (mode)
+    {
+    case VK_PRESENT_MODE_IMMEDIATE_KHR:
+        return "IMMEDIATE";
+    case VK_PRESENT_MODE_MAILBOX_KHR:
+        return "MAILBOX";
+    case VK_PRESENT_MODE_FIFO_KHR:
+        return "FIFO";
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+        return "FIFO_RELAXED";
+    default:
+        return "other";
+    }
+}
+
+// 40 - Options that can be changed from the command line without a rebuild.
+struct AppConfig
+{
+    uint32_t framesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
+
+    // Stop after this many frames, 0 means run until the window is closed.
+    // Useful to get comparable frames per second numbers between machines.
+    uint64_t maxFrames = 0;
+
+    // Render into our own images without a window, a surface or presentation.
+    // Meant for machines without a display (render servers, CI).
+    bool headless = false;
+
+    // Use this device instead of the best rated one. Matches part of the
+    // device name (any case) or the full device UUID.
+    std::string deviceOverride;
+
+    // Priorities of the queues we ask for in every family, highest first.
+    // Families with fewer queues only get the first ones. The first queue is
+    // for latency sensitive work, the last one for background work.
+    std::vector<float> queuePriorities = {1.0f, 0.0f};
+
+    // Can be changed while running, see FirstVulkanExample::setPresentPolicy.
+    PresentPolicy presentPolicy = PresentPolicy::TearFreeThroughput;
+
+    // Images in the swap chain, 0 means one more than frames in flight: one
+    // being shown while every frame slot renders into its own image.
+    uint32_t swapChainImages = 0;
+
+    // Measure acquire stalls and change the number of images while running.
+    bool autoTuneImages = false;
+
+    // Where the pipeline cache lives between runs, empty disables it.
+    std::string pipelineCachePath = "pipeline_cache.bin";
+
+    // Ignore the cache on disk, to compare a cold start against a warm one.
+    bool coldStart = false;
+
+    // Megabytes to push through the staging ring at startup, 0 skips it.
+    uint32_t benchUploadMegabytes = 0;
+
+    // Worker threads recording secondary command buffers, 0 records
+    // everything on the main thread into the primary.
+    uint32_t recordThreads = 0;
+
+    // Draws recorded every frame, to see how recording scales.
+    uint32_t drawItems = 0;
+
+    // Time the recording of a frame with 1, 2, 4... threads at startup.
+    bool benchRecord = false;
+
+    // Add a chain of passes through transient images to the frame, shown in
+    // a corner of the window. Shows the memory saved by aliasing.
+    bool transientDemo = false;
+
+    // Time every pass on the GPU, shown in the window title. With a path the
+    // min/avg/p99 table is written there at exit.
+    bool gpuProfile = false;
+    std::string gpuProfilePath;
+
+    // Record CPU zones and write them as a Chrome trace here at exit.
+    std::string cpuTracePath;
+
+    // Messages below this level are not logged.
+    biniutils::LogLevel logLevel = biniutils::LogLevel::Info;
+
+    // Validation layers, on by default in debug builds. The VULKAN_VALIDATION
+    // environment variable (0 or 1) and --validation / --no-validation change
+    // it without a rebuild.
+    bool validation = enableValidationLayers;
+    VkDebugUtilsMessageSeverityFlagBitsEXT validationSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT;
+    // Extra checks of VK_EXT_validation_features: best-practices, sync,
+    // gpu-assisted, debug-printf.
+    std::vector<std::string> validationFeatures;
+    // Message IDs that are never logged.
+    std::vector<std::string> validationIgnore;
+};
+
+AppConfig parseArguments(int argc, char **argv)
+{
+    AppConfig config;
+
+    // The environment first so the command line wins.
+    const char *validationEnv = std::getenv("VULKAN_VALIDATION");
+    if (validationEnv != nullptr && validationEnv[0] != '\0')
+    {
+        config.validation = std::string(validationEnv) != "0";
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        // Flags without a value.
+        if (arg == "--headless")
+        {
+            config.headless = true;
+            continue;
+        }
+        if (arg == "--auto-tune-images")
+        {
+            config.autoTuneImages = true;
+            continue;
+        }
+        if (arg == "--cold-start")
+        {
+            config.coldStart = true;
+            continue;
+        }
+        if (arg == "--bench-record")
+        {
+            config.benchRecord = true;
+            continue;
+        }
+        if (arg == "--transient-demo")
+        {
+            config.transientDemo = true;
+            continue;
+        }
+        if (arg == "--gpu-profile")
+        {
+            config.gpuProfile = true;
+            continue;
+        }
+        if (arg == "--validation" || arg == "--no-validation")
+        {
+            config.validation = arg == "--validation";
+            continue;
+        }
+
+        // Every other option takes a value after it.
+        if (i + 1 >= argc)
+        {
+            throw std::runtime_error("Missing value for argument " + arg);
+        }
+        std::string value = argv[++i];
+
+        if (arg == "--frames-in-flight")
+        {
+            config.framesInFlight = static_cast<uint32_t>(std::stoul(value));
+            if (config.framesInFlight == 0)
+            {
+                throw std::runtime_error("--frames-in-flight needs to be at least 1");
+            }
+        }
+        else if (arg == "--max-frames")
+        {
+            config.maxFrames = std::stoull(value);
+        }
+        else if (arg == "--swapchain-images")
+        {
+            config.swapChainImages = static_cast<uint32_t>(std::stoul(value));
+        }
+        else if (arg == "--bench-upload")
+        {
+            config.benchUploadMegabytes = static_cast<uint32_t>(std::stoul(value));
+        }
+        else if (arg == "--record-threads")
+        {
+            config.recordThreads = static_cast<uint32_t>(std::stoul(value));
+        }
+        else if (arg == "--draws")
+        {
+            config.drawItems = static_cast<uint32_t>(std::stoul(value));
+        }
+        else if (arg == "--gpu-profile-dump")
+        {
+            config.gpuProfile = true;
+            config.gpuProfilePath = value;
+        }
+        else if (arg == "--cpu-trace")
+        {
+            config.cpuTracePath = value;
+        }
+        else if (arg == "--log-level")
+        {
+            const std::pair<const char *, biniutils::LogLevel> levels[] = {{"debug", biniutils::LogLevel::Debug}, {"info", biniutils::LogLevel::Info},
+                                                                           {"warning", biniutils::LogLevel::Warning}, {"error", biniutils::LogLevel::Error}};
+            bool found = false;
+            for (const auto &level : levels)
+            {
+                if (value == level.first)
+                {
+                    config.logLevel = level.second;
+                    found = true;
+                }
+            }
+            if (!found)
+            {
+                throw std::runtime_error("--log-level has to be debug, info, warning or error");
+            }
+        }
+        else if (arg == "--validation-severity")
+        {
+            const std::pair<const char *, VkDebugUtilsMessageSeverityFlagBitsEXT> severities[] = {
+                {"verbose", VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT}, {"info", VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT},
+                {"warning", VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT}, {"error", VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT}};
+            bool found = false;
+            for (const auto &severity : severities)
+            {
+                if (value == severity.first)
+                {
+                    config.validationSeverity = severity.second;
+                    found = true;
+                }
+            }
+            if (!found)
+            {
+                throw std::runtime_error("--validation-severity has to be verbose, info, warning or error");
+            }
+        }
+        else if (arg == "--validation-features")
+        {
+            config.validationFeatures = biniutils::splitList(value);
+            for (const auto &feature : config.validationFeatures)
+            {
+                if (feature != "best-practices" && feature != "sync" && feature != "gpu-assisted" && feature != "debug-printf")
+                {
+                    throw std::runtime_error("Unknown validation feature " + feature);
+                }
+            }
+            // Asking for the checks means asking for validation.
+            config.validation = true;
+        }
+        else if (arg == "--validation-ignore")
+        {
+            config.validationIgnore = biniutils::splitList(value);
+        }
+        else if (arg == "--pipeline-cache")
+        {
+            config.pipelineCachePath = value;
+        }
+        else if (arg == "--device")
+        {
+            config.deviceOverride = value;
+        }
+        else if (arg == "--present-policy")
+        {
+            bool found = false;
+            for (auto policy : {PresentPolicy::LowestLatency, PresentPolicy::PowerSaving, PresentPolicy::TearFreeThroughput, PresentPolicy::UncappedBenchmark})
+            {
+                if (value == presentPolicyName(policy))
+                {
+                    config.presentPolicy = policy;
+                    found = true;
+                }
+            }
+            if (!found)
+            {
+                throw std::runtime_error("--present-policy has to be latency, power, tearfree or benchmark");
+            }
+        }
+        else if (arg == "--queue-priorities")
+        {
+            // Comma separated, for example 1.0,0.5,0.0
+            config.queuePriorities.clear();
+            for (const auto &part : biniutils::splitList(value))
+            {
+                float priority = std::stof(part);
+                if (priority < 0.0f || priority > 1.0f)
+                {
+                    throw std::runtime_error("Queue priorities have to be between 0.0 and 1.0");
+                }
+                config.queuePriorities.push_back(priority);
+            }
+            std::sort(config.queuePriorities.begin(), config.queuePriorities.end(), std::greater<float>());
+        }
+        else
+        {
+            throw std::runtime_error("Unknown argument " + arg);
+        }
+    }
+    return config;
+}
+
+// 1.6 - We are going to create an struct that contains
+struct QueueFamilyIndexes
+{
+    std::optional<uint32_t> graphicsFamily;
+
+    // 18 - Add a second index for the presentation queue family.
+    std::optional<uint32_t> presentFamily;
+
+    // 52 - Families that only do compute or only do transfers. Work submitted
+    // to them can run at the same time as graphics. Empty if the device has none.
+    std::optional<uint32_t> computeFamily;
+    std::optional<uint32_t> transferFamily;
+
+    // Without a surface (headless) there is nothing to present to.
+    bool presentRequired = true;
+
+    // 1.7 Convienience method to verify that they have value
+    bool isComplete()
+    {
+        return graphicsFamily.has_value() && (presentFamily.has_value() || !presentRequired);
+    }
+};
+
+// 25 - We need to do more than just check for chain swap support.
+// We need to setup the chain swap and save several references that will
+// be used later.
+struct SwapChainSupportDetails
+{
+    VkSurfaceCapabilitiesKHR capabilities;
+    std::vector<VkSurfaceFormatKHR> formats;
+    std::vector<VkPresentModeKHR> presentModes;
+};
+
+// 69 - How a memory block hands out its space.
+enum class AllocationStrategy
+{
+    // Power of two blocks that merge back when freed. General purpose.
+    Buddy,
+    // Just move a pointer forward, the block is reused once everything in it
+    // was freed. For short lived data (per frame, staging).
+    Linear,
+};
+
+// Buffers and linear images can't share a block with optimal images without
+// respecting bufferImageGranularity, so they get separate arenas.
+enum class ResourceKind
+{
+    Linear,
+    OptimalImage,
+};
+
+// A big VkDeviceMemory we carve allocations out of.
+struct MemoryBlock
+{
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    // Host visible blocks stay mapped for their whole life.
+    void *mapped = nullptr;
+    AllocationStrategy strategy = AllocationStrategy::Buddy;
+    uint32_t allocationCount = 0;
+    // Bytes handed out, including what the rounding wastes.
+    VkDeviceSize reserved = 0;
+
+    // Linear: next free offset.
+    VkDeviceSize head = 0;
+
+    // Buddy: free offsets per order, order k holds blocks of MIN_BUDDY_SIZE << k.
+    std::vector<std::set<VkDeviceSize>> freeLists;
+};
+
+// What the allocator hands out. Bind with memory + offset, write through mapped.
+struct MemoryAllocation
+{
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void *mapped = nullptr;
+    uint32_t memoryTypeIndex = 0;
+
+    // Bookkeeping to give it back, no block means a dedicated allocation.
+    MemoryBlock *block = nullptr;
+    uint32_t buddyOrder = 0;
+};
+
+struct MemoryStats
+{
+    // Bytes of VkDeviceMemory we allocated from the driver.
+    VkDeviceSize bytesAllocated = 0;
+    // Bytes the resources asked for.
+    VkDeviceSize bytesUsed = 0;
+    uint32_t blockCount = 0;
+    uint32_t dedicatedCount = 0;
+    uint32_t allocationCount = 0;
+    // 0 means all free space is in one piece, close to 1 means it's in crumbs.
+    double fragmentation = 0.0;
+};
+
+// 70 - Sub-allocator on top of the logical device. Every memory type gets
+// arenas of big blocks so we need a handful of vkAllocateMemory calls instead
+// of one per resource (maxMemoryAllocationCount can be as low as 4096).
+// Resources too big for a block get their own dedicated allocation.
+class DeviceMemoryAllocator
+{
+public:
+    static constexpr VkDeviceSize DEFAULT_BLOCK_SIZE = 64ull * 1024 * 1024;
+    static constexpr VkDeviceSize MIN_BUDDY_SIZE = 256;
+
+    void init(VkPhysicalDevice physicalDevice, VkDevice logicalDevice, uint32_t apiVersion)
+    {
+        device = logicalDevice;
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        maxAllocations = properties.limits.maxMemoryAllocationCount;
+        // Dedicated allocation info and the *2 queries are core since 1.1.
+        supportsDedicated = apiVersion >= VK_API_VERSION_1_1;
+
+        arenas.clear();
+        arenas.resize(memoryProperties.memoryTypeCount * 2);
+    }
+
+    void cleanup()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &arena : arenas)
+        {
+            for (auto &block : arena)
+            {
+                if (block->allocationCount > 0)
+                {
+                    BINI_LOG(Warning, Memory, "Memory block destroyed with " + std::to_string(block->allocationCount) + " allocation(s) still alive!");
+                }
+                freeDeviceMemory(block->memory);
+            }
+            arena.clear();
+        }
+    }
+
+    // Memory for an image, bound before returning. Optimal images go through
+    // the driver's dedicated allocation hint when it has one.
+    MemoryAllocation allocateForImage(VkImage image, VkMemoryPropertyFlags properties, bool linearTiling = false)
+    {
+        bool dedicated = false;
+        VkMemoryRequirements requirements = imageRequirements(image, dedicated);
+        MemoryAllocation allocation = allocate(requirements, properties, linearTiling ? ResourceKind::Linear : ResourceKind::OptimalImage,
+                                               AllocationStrategy::Buddy, dedicated, image, VK_NULL_HANDLE);
+        if (vkBindImageMemory(device, image, allocation.memory, allocation.offset) != VK_SUCCESS)
+        {
+            free(allocation);
+            throw std::runtime_error("Failed to bind image memory!");
+        }
+        return allocation;
+    }
+
+    // Memory for a buffer, bound before returning.
+    MemoryAllocation allocateForBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties, AllocationStrategy strategy = AllocationStrategy::Buddy)
+    {
+        bool dedicated = false;
+        VkMemoryRequirements requirements = bufferRequirements(buffer, dedicated);
+        MemoryAllocation allocation = allocate(requirements, properties, ResourceKind::Linear, strategy, dedicated, VK_NULL_HANDLE, buffer);
+        if (vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset) != VK_SUCCESS)
+        {
+            free(allocation);
+            throw std::runtime_error("Failed to bind buffer memory!");
+        }
+        return allocation;
+    }
+
+    MemoryAllocation allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags properties, ResourceKind kind,
+                              AllocationStrategy strategy = AllocationStrategy::Buddy, bool dedicated = false,
+                              VkImage dedicatedImage = VK_NULL_HANDLE, VkBuffer dedicatedBuffer = VK_NULL_HANDLE)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // Try every memory type that fits, the first ones are the preferred ones.
+        for (uint32_t type = 0; type < memoryProperties.memoryTypeCount; type++)
+        {
+            if (!(requirements.memoryTypeBits & (1u << type)) || (memoryProperties.memoryTypes[type].propertyFlags & properties) != properties)
+            {
+                continue;
+            }
+
+            MemoryAllocation allocation;
+            allocation.memoryTypeIndex = type;
+            allocation.size = requirements.size;
+
+            VkDeviceSize blockSize = blockSizeFor(type);
+            if (dedicated || requirements.size > blockSize / 2)
+            {
+                if (allocateDedicated(allocation, requirements.size, dedicatedImage, dedicatedBuffer))
+                {
+                    return allocation;
+                }
+                continue;
+            }
+
+            auto &arena = arenas[type * 2 + (kind == ResourceKind::OptimalImage ? 1 : 0)];
+            for (auto &block : arena)
+            {
+                if (block->strategy == strategy && allocateFromBlock(*block, requirements, allocation))
+                {
+                    return allocation;
+                }
+            }
+
+            // Nothing free, time for a new block.
+            std::unique_ptr<MemoryBlock> block = createBlock(type, blockSize, strategy);
+            if (!block)
+            {
+                continue;
+            }
+            if (!allocateFromBlock(*block, requirements, allocation))
+            {
+                // Doesn't fit even an empty block (e.g. an alignment bigger
+                // than the block), give it its own memory instead.
+                freeDeviceMemory(block->memory);
+                if (allocateDedicated(allocation, requirements.size, dedicatedImage, dedicatedBuffer))
+                {
+                    return allocation;
+                }
+                continue;
+            }
+            arena.push_back(std::move(block));
+            return allocation;
+        }
+        throw std::runtime_error("Failed to find memory for an allocation of " + std::to_string(requirements.size) + " bytes!");
+    }
+
+    // Is there a memory type among typeBits with all of these properties.
+    bool hasMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties) const
+    {
+        for (uint32_t type = 0; type < memoryProperties.memoryTypeCount; type++)
+        {
+            if ((typeBits & (1u << type)) && (memoryProperties.memoryTypes[type].propertyFlags & properties) == properties)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void free(MemoryAllocation &allocation)
+    {
+        if (allocation.memory == VK_NULL_HANDLE)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (allocation.block == nullptr)
+        {
+            dedicatedBytes -= allocation.size;
+            dedicatedCount--;
+            freeDeviceMemory(allocation.memory);
+            allocation = MemoryAllocation{};
+            return;
+        }
+
+        MemoryBlock &block = *allocation.block;
+        block.allocationCount--;
+        usedBytes -= allocation.size;
+        if (block.strategy == AllocationStrategy::Buddy)
+        {
+            freeBuddy(block, allocation.offset, allocation.buddyOrder);
+        }
+        else if (block.allocationCount == 0)
+        {
+            // Linear blocks only come back when they are empty.
+            block.head = 0;
+            block.reserved = 0;
+        }
+
+        // Keep one empty block per arena around, give the rest back.
+        if (block.allocationCount == 0)
+        {
+            auto &arena = arenaOf(allocation.block);
+            size_t empty = std::count_if(arena.begin(), arena.end(), [](const std::unique_ptr<MemoryBlock> &b)
+                                         { return b->allocationCount == 0; });
+            if (empty > 1)
+            {
+                freeDeviceMemory(block.memory);
+                arena.erase(std::find_if(arena.begin(), arena.end(), [&block](const std::unique_ptr<MemoryBlock> &b)
+                                         { return b.get() == &block; }));
+            }
+        }
+        allocation = MemoryAllocation{};
+    }
+
+    // 71 - Numbers to see how well the allocator is doing.
+    MemoryStats stats()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryStats result;
+        result.bytesUsed = usedBytes + dedicatedBytes;
+        result.bytesAllocated = dedicatedBytes;
+        result.dedicatedCount = dedicatedCount;
+        result.allocationCount = dedicatedCount;
+
+        VkDeviceSize totalFree = 0;
+        VkDeviceSize largestFree = 0;
+        for (auto &arena : arenas)
+        {
+            for (auto &block : arena)
+            {
+                result.bytesAllocated += block->size;
+                result.blockCount++;
+                result.allocationCount += block->allocationCount;
+                totalFree += block->size - block->reserved;
+                largestFree = std::max(largestFree, largestFreeRange(*block));
+            }
+        }
+        if (totalFree > 0)
+        {
+            result.fragmentation = 1.0 - static_cast<double>(largestFree) / static_cast<double>(totalFree);
+        }
+        return result;
+    }
+
+    void logStats()
+    {
+        MemoryStats s = stats();
+        BINI_LOG(Info, Memory, "GPU memory: " + std::to_string(s.bytesUsed / 1024) + " KiB used of " + std::to_string(s.bytesAllocated / 1024) +
+                               " KiB allocated, " + std::to_string(s.allocationCount) + " allocations in " + std::to_string(s.blockCount) +
+                               " blocks + " + std::to_string(s.dedicatedCount) + " dedicated, fragmentation " + std::to_string(s.fragmentation));
+    }
+
+private:
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memoryProperties{};
+    uint32_t maxAllocations = 4096;
+    bool supportsDedicated = false;
+
+    // Two arenas per memory type, see ResourceKind.
+    std::vector<std::vector<std::unique_ptr<MemoryBlock>>> arenas;
+
+    VkDeviceSize usedBytes = 0;
+    VkDeviceSize dedicatedBytes = 0;
+    uint32_t dedicatedCount = 0;
+    uint32_t deviceMemoryCount = 0;
+    std::mutex mutex;
+
+    VkMemoryRequirements imageRequirements(VkImage image, bool &dedicated)
+    {
+        if (!supportsDedicated)
+        {
+            VkMemoryRequirements requirements;
+            vkGetImageMemoryRequirements(device, image, &requirements);
+            return requirements;
+        }
+        VkMemoryDedicatedRequirements dedicatedRequirements{};
+        dedicatedRequirements.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+        VkMemoryRequirements2 requirements{};
+        requirements.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+        requirements.pNext = &dedicatedRequirements;
+        VkImageMemoryRequirementsInfo2 info{};
+        info.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
+        info.image = image;
+        vkGetImageMemoryRequirements2(device, &info, &requirements);
+        dedicated = dedicatedRequirements.prefersDedicatedAllocation || dedicatedRequirements.requiresDedicatedAllocation;
+        return requirements.memoryRequirements;
+    }
+
+    VkMemoryRequirements bufferRequirements(VkBuffer buffer, bool &dedicated)
+    {
+        if (!supportsDedicated)
+        {
+            VkMemoryRequirements requirements;
+            vkGetBufferMemoryRequirements(device, buffer, &requirements);
+            return requirements;
+        }
+        VkMemoryDedicatedRequirements dedicatedRequirements{};
+        dedicatedRequirements.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+        VkMemoryRequirements2 requirements{};
+        requirements.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+        requirements.pNext = &dedicatedRequirements;
+        VkBufferMemoryRequirementsInfo2 info{};
+        info.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2;
+        info.buffer = buffer;
+        vkGetBufferMemoryRequirements2(device, &info, &requirements);
+        // Buffers only when the driver really needs it, sub-allocating them is cheap.
+        dedicated = dedicatedRequirements.requiresDedicatedAllocation;
+        return requirements.memoryRequirements;
+    }
+
+    // Small heaps (integrated GPUs, lavapipe host memory types) get smaller
+    // blocks. Always a power of two so the buddy orders work out.
+    VkDeviceSize blockSizeFor(uint32_t type)
+    {
+        VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[type].heapIndex].size;
+        VkDeviceSize blockSize = DEFAULT_BLOCK_SIZE;
+        while (blockSize > MIN_BUDDY_SIZE && blockSize > heapSize / 8)
+        {
+            blockSize /= 2;
+        }
+        return blockSize;
+    }
+
+    VkDeviceMemory allocateDeviceMemory(uint32_t type, VkDeviceSize size, const void *pNext)
+    {
+        if (deviceMemoryCount >= maxAllocations)
+        {
+            throw std::runtime_error("Reached maxMemoryAllocationCount (" + std::to_string(maxAllocations) + ")!");
+        }
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.pNext = pNext;
+        allocInfo.allocationSize = size;
+        allocInfo.memoryTypeIndex = type;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        if (vkAllocateMemory(device, &allocInfo, nullptr, &memory) != VK_SUCCESS)
+        {
+            // Out of memory in this type, the caller tries the next one.
+            return VK_NULL_HANDLE;
+        }
+        deviceMemoryCount++;
+        return memory;
+    }
+
+    void freeDeviceMemory(VkDeviceMemory memory)
+    {
+        // Freeing also unmaps.
+        vkFreeMemory(device, memory, nullptr);
+        deviceMemoryCount--;
+    }
+
+    void *mapIfHostVisible(uint32_t type, VkDeviceMemory memory)
+    {
+        void *mapped = nullptr;
+        if (memoryProperties.memoryTypes[type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+        {
+            vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+        }
+        return mapped;
+    }
+
+    bool allocateDedicated(MemoryAllocation &allocation, VkDeviceSize size, VkImage image, VkBuffer buffer)
+    {
+        VkMemoryDedicatedAllocateInfo dedicatedInfo{};
+        dedicatedInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+        dedicatedInfo.image = image;
+        dedicatedInfo.buffer = buffer;
+        bool useInfo = supportsDedicated && (image != VK_NULL_HANDLE || buffer != VK_NULL_HANDLE);
+
+        allocation.memory = allocateDeviceMemory(allocation.memoryTypeIndex, size, useInfo ? &dedicatedInfo : nullptr);
+        if (allocation.memory == VK_NULL_HANDLE)
+        {
+            return false;
+        }
+        allocation.offset = 0;
+        allocation.mapped = mapIfHostVisible(allocation.memoryTypeIndex, allocation.memory);
+        dedicatedBytes += size;
+        dedicatedCount++;
+        return true;
+    }
+
+    std::unique_ptr<MemoryBlock> createBlock(uint32_t type, VkDeviceSize size, AllocationStrategy strategy)
+    {
+        VkDeviceMemory memory = allocateDeviceMemory(type, size, nullptr);
+        if (memory == VK_NULL_HANDLE)
+        {
+            return nullptr;
+        }
+        auto block = std::make_unique<MemoryBlock>();
+        block->memory = memory;
+        block->size = size;
+        block->strategy = strategy;
+        block->mapped = mapIfHostVisible(type, memory);
+        if (strategy == AllocationStrategy::Buddy)
+        {
+            uint32_t maxOrder = orderFor(size);
+            block->freeLists.resize(maxOrder + 1);
+            block->freeLists[maxOrder].insert(0);
+        }
+        return block;
+    }
+
+    // Smallest order whose blocks hold size bytes.
+    static uint32_t orderFor(VkDeviceSize size)
+    {
+        uint32_t order = 0;
+        while ((MIN_BUDDY_SIZE << order) < size)
+        {
+            order++;
+        }
+        return order;
+    }
+
+    bool allocateFromBlock(MemoryBlock &block, const VkMemoryRequirements &requirements, MemoryAllocation &allocation)
+    {
+        VkDeviceSize offset = 0;
+        VkDeviceSize reserved = 0;
+        if (block.strategy == AllocationStrategy::Linear)
+        {
+            VkDeviceSize alignment = std::max<VkDeviceSize>(requirements.alignment, 1);
+            offset = (block.head + alignment - 1) / alignment * alignment;
+            if (offset + requirements.size > block.size)
+            {
+                return false;
+            }
+            reserved = offset + requirements.size - block.head;
+            block.head = offset + requirements.size;
+        }
+        else
+        {
+            // Buddy blocks are aligned to their own size, asking for at least
+            // the alignment takes care of it.
+            uint32_t order = orderFor(std::max(requirements.size, requirements.alignment));
+            uint32_t found = order;
+            while (found < block.freeLists.size() && block.freeLists[found].empty())
+            {
+                found++;
+            }
+            if (found >= block.freeLists.size())
+            {
+                return false;
+            }
+            offset = *block.freeLists[found].begin();
+            block.freeLists[found].erase(block.freeLists[found].begin());
+            // Split down to the size we need, the upper halves become free.
+            while (found > order)
+            {
+                found--;
+                block.freeLists[found].insert(offset + (MIN_BUDDY_SIZE << found));
+            }
+            allocation.buddyOrder = order;
+            reserved = MIN_BUDDY_SIZE << order;
+        }
+
+        block.allocationCount++;
+        block.reserved += reserved;
+        usedBytes += requirements.size;
+
+        allocation.memory = block.memory;
+        allocation.offset = offset;
+        allocation.block = &block;
+        allocation.mapped = block.mapped ? static_cast<char *>(block.mapped) + offset : nullptr;
+        return true;
+    }
+
+    void freeBuddy(MemoryBlock &block, VkDeviceSize offset, uint32_t order)
+    {
+        block.reserved -= MIN_BUDDY_SIZE << order;
+        // Merge with the buddy as long as it's free too.
+        while (order + 1 < block.freeLists.size())
+        {
+            VkDeviceSize buddy = offset ^ (MIN_BUDDY_SIZE << order);
+            if (block.freeLists[order].erase(buddy) == 0)
+            {
+                break;
+            }
+            offset = std::min(offset, buddy);
+            order++;
+        }
+        block.freeLists[order].insert(offset);
+    }
+
+    static VkDeviceSize largestFreeRange(const MemoryBlock &block)
+    {
+        if (block.strategy == AllocationStrategy::Linear)
+        {
+            return block.size - block.head;
+        }
+        for (size_t order = block.freeLists.size(); order > 0; order--)
+        {
+            if (!block.freeLists[order - 1].empty())
+            {
+                return MIN_BUDDY_SIZE << (order - 1);
+            }
+        }
+        return 0;
+    }
+
+    std::vector<std::unique_ptr<MemoryBlock>> &arenaOf(const MemoryBlock *block)
+    {
+        for (auto &arena : arenas)
+        {
+            for (auto &candidate : arena)
+            {
+                if (candidate.get() == block)
+                {
+                    return arena;
+                }
+            }
+        }
+        throw std::runtime_error("Memory block doesn't belong to this allocator!");
+    }
+};
+
+// 55 - One queue of a family and the priority it got. A VkQueue must not be
+// used by two threads at the same time, so every queue has its own lock and
+// threads that use different queues never wait on each other.
+struct PriorityQueue
+{
+    VkQueue queue = VK_NULL_HANDLE;
+    float priority = 1.0f;
+    std::unique_ptr<std::mutex> lock = std::make_unique<std::mutex>();
+};
+
+// 102 - When the GPU is done with what. Every lane (one per kind of submit:
+// graphics, compute, transfer) has a counter that only goes up, each submit
+// signals the next value and the CPU can poll or wait for any value later,
+// no matter how old. With timeline semaphores that is one semaphore per lane
+// and no fences at all, other queues can also wait on the values on the GPU.
+// Without them every submit borrows a fence from a pool and the counter is
+// kept on the CPU, the interface stays the same.
+//
+// A lane must only be signaled from one queue, the values have to complete in order.
+class GpuTimeline
+{
+public:
+    enum class Lane : uint32_t
+    {
+        Graphics,
+        Compute,
+        Transfer,
+        Count
+    };
+
+    // A moment on a lane. Value 0 is before the first submit, always reached.
+    struct Point
+    {
+        Lane lane = Lane::Graphics;
+        uint64_t value = 0;
+    };
+
+    // The semaphores of one submit: what the caller waits on and signals, plus
+    // the timeline value. Must stay alive until vkQueueSubmit returned.
+    class Submit
+    {
+    public:
+        static constexpr uint32_t MAX_SEMAPHORES = 4;
+
+        void wait(VkSemaphore semaphore, VkPipelineStageFlags stage, uint64_t value = 0)
+        {
+            if (waitCount == MAX_SEMAPHORES)
+            {
+                throw std::runtime_error("Too many semaphores to wait on in a single submit!");
+            }
+            waitSemaphores[waitCount] = semaphore;
+            waitStages[waitCount] = stage;
+            waitValues[waitCount++] = value;
+        }
+
+        void signal(VkSemaphore semaphore, uint64_t value = 0)
+        {
+            if (signalCount == MAX_SEMAPHORES)
+            {
+                throw std::runtime_error("Too many semaphores to signal in a single submit!");
+            }
+            signalSemaphores[signalCount] = semaphore;
+            signalValues[signalCount++] = value;
+        }
+
+        void fill(VkSubmitInfo &submitInfo)
+        {
+            submitInfo.waitSemaphoreCount = waitCount;
+            submitInfo.pWaitSemaphores = waitSemaphores;
+            submitInfo.pWaitDstStageMask = waitStages;
+            submitInfo.signalSemaphoreCount = signalCount;
+            submitInfo.pSignalSemaphores = signalSemaphores;
+            // Binary semaphores ignore their value, so all of them can be given.
+            if (timeline)
+            {
+                timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+                timelineInfo.pNext = submitInfo.pNext;
+                timelineInfo.waitSemaphoreValueCount = waitCount;
+                timelineInfo.pWaitSemaphoreValues = waitValues;
+                timelineInfo.signalSemaphoreValueCount = signalCount;
+                timelineInfo.pSignalSemaphoreValues = signalValues;
+                submitInfo.pNext = &timelineInfo;
+            }
+        }
+
+        // What this submit signals once GpuTimeline::prepare() ran.
+        Point point;
+        // Only without timeline semaphores, to pass to vkQueueSubmit.
+        VkFence fence = VK_NULL_HANDLE;
+
+    private:
+        friend class GpuTimeline;
+        VkSemaphore waitSemaphores[MAX_SEMAPHORES];
+        VkPipelineStageFlags waitStages[MAX_SEMAPHORES];
+        uint64_t waitValues[MAX_SEMAPHORES];
+        uint32_t waitCount = 0;
+        VkSemaphore signalSemaphores[MAX_SEMAPHORES];
+        uint64_t signalValues[MAX_SEMAPHORES];
+        uint32_t signalCount = 0;
+        bool timeline = false;
+        VkTimelineSemaphoreSubmitInfo timelineInfo{};
+    };
+
+    void init(VkDevice logicalDevice, bool useTimelineSemaphores, uint32_t apiVersion)
+    {
+        device = logicalDevice;
+        timelineSemaphores = useTimelineSemaphores;
+        if (!timelineSemaphores)
+        {
+            return;
+        }
+
+        // Core names since 1.2, the extension ones before.
+        bool core = apiVersion >= VK_API_VERSION_1_2;
+        waitSemaphores = reinterpret_cast<PFN_vkWaitSemaphoresKHR>(
+            vkGetDeviceProcAddr(device, core ? "vkWaitSemaphores" : "vkWaitSemaphoresKHR"));
+        getCounterValue = reinterpret_cast<PFN_vkGetSemaphoreCounterValueKHR>(
+            vkGetDeviceProcAddr(device, core ? "vkGetSemaphoreCounterValue" : "vkGetSemaphoreCounterValueKHR"));
+        if (waitSemaphores == nullptr || getCounterValue == nullptr)
+        {
+            throw std::runtime_error("Timeline semaphores enabled but their functions are missing!");
+        }
+
+        VkSemaphoreTypeCreateInfo typeInfo{};
+        typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        typeInfo.initialValue = 0;
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        semaphoreInfo.pNext = &typeInfo;
+        for (auto &lane : lanes)
+        {
+            if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &lane.semaphore) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create timeline semaphore!");
+            }
+        }
+    }
+
+    void cleanup()
+    {
+        waitIdle();
+        for (auto &lane : lanes)
+        {
+            if (lane.semaphore != VK_NULL_HANDLE)
+            {
+                vkDestroySemaphore(device, lane.semaphore, nullptr);
+            }
+            lane.semaphore = VK_NULL_HANDLE;
+            lane.submitted = 0;
+            lane.completed = 0;
+        }
+        for (VkFence fence : freeFences)
+        {
+            vkDestroyFence(device, fence, nullptr);
+        }
+        BINI_LOG(Info, Render, "GPU timeline: " + std::to_string(hostWaits) + " blocking host waits, " +
+                               (timelineSemaphores ? std::to_string(static_cast<uint32_t>(Lane::Count)) + " timeline semaphores"
+                                                   : std::to_string(freeFences.size()) + " fences"));
+        freeFences.clear();
+    }
+
+    bool usesTimelineSemaphores() const
+    {
+        return timelineSemaphores;
+    }
+
+    // The lane's semaphore, for other submits to wait on. Only with timeline semaphores.
+    VkSemaphore semaphore(Lane lane) const
+    {
+        return lanes[index(lane)].semaphore;
+    }
+
+    // The latest value handed out on the lane.
+    Point last(Lane lane) const
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        return {lane, lanes[index(lane)].submitted};
+    }
+
+    // The value the next submit on the lane will signal, for work being recorded.
+    Point next(Lane lane) const
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        return {lane, lanes[index(lane)].submitted + 1};
+    }
+
+    // Gives the submit the next value of the lane. Call right before
+    // vkQueueSubmit, submits of one lane have to reach the queue in this order.
+    void prepare(Lane lane, Submit &submit)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        LaneState &state = lanes[index(lane)];
+        submit.point = {lane, ++state.submitted};
+        submit.timeline = timelineSemaphores;
+        if (timelineSemaphores)
+        {
+            submit.signal(state.semaphore, submit.point.value);
+            return;
+        }
+
+        if (freeFences.empty())
+        {
+            VkFenceCreateInfo fenceInfo{};
+            fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            VkFence fence;
+            if (vkCreateFence(device, &fenceInfo, nullptr, &fence) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create timeline fence!");
+            }
+            freeFences.push_back(fence);
+        }
+        submit.fence = freeFences.back();
+        freeFences.pop_back();
+        state.pending.push_back({submit.point.value, submit.fence});
+    }
+
+    // Makes the submit wait on the GPU for a point of another lane. Without
+    // timeline semaphores that's impossible, returns false and the caller
+    // has to order the work another way.
+    bool waitOnGpu(Submit &submit, Point point, VkPipelineStageFlags stage)
+    {
+        if (!timelineSemaphores)
+        {
+            return false;
+        }
+        if (!reached(point))
+        {
+            submit.wait(lanes[index(point.lane)].semaphore, stage, point.value);
+        }
+        return true;
+    }
+
+    // Never blocks.
+    bool reached(Point point)
+    {
+        LaneState &state = lanes[index(point.lane)];
+        if (point.value <= state.completed.load(std::memory_order_acquire))
+        {
+            return true;
+        }
+        refresh(point.lane);
+        return point.value <= state.completed.load(std::memory_order_acquire);
+    }
+
+    // Blocks until the point is reached or the timeout (in ns) ran out.
+    bool wait(Point point, uint64_t timeout = UINT64_MAX)
+    {
+        if (reached(point))
+        {
+            return true;
+        }
+        CPU_ZONE("GpuTimeline::wait");
+        hostWaits++;
+        LaneState &state = lanes[index(point.lane)];
+        VkResult result;
+        if (timelineSemaphores)
+        {
+            VkSemaphoreWaitInfo waitInfo{};
+            waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+            waitInfo.semaphoreCount = 1;
+            waitInfo.pSemaphores = &state.semaphore;
+            waitInfo.pValues = &point.value;
+            result = waitSemaphores(device, &waitInfo, timeout);
+        }
+        else
+        {
+            // The first pending fence at or past the point covers it. While we
+            // wait on it refresh() must not reset it or hand it to another submit.
+            VkFence fence = VK_NULL_HANDLE;
+            {
+                std::lock_guard<std::mutex> guard(mutex);
+                for (const auto &pending : state.pending)
+                {
+                    if (pending.value >= point.value)
+                    {
+                        fence = pending.fence;
+                        waitedFences[fence].count++;
+                        break;
+                    }
+                }
+            }
+            if (fence == VK_NULL_HANDLE)
+            {
+                return reached(point);
+            }
+            result = vkWaitForFences(device, 1, &fence, VK_TRUE, timeout);
+            {
+                std::lock_guard<std::mutex> guard(mutex);
+                auto waited = waitedFences.find(fence);
+                if (--waited->second.count == 0)
+                {
+                    // The last waiter recycles what refresh() left alone.
+                    if (waited->second.finished)
+                    {
+                        vkResetFences(device, 1, &fence);
+                        freeFences.push_back(fence);
+                    }
+                    waitedFences.erase(waited);
+                }
+            }
+        }
+        if (result != VK_SUCCESS && result != VK_TIMEOUT)
+        {
+            throw std::runtime_error("Failed to wait for the GPU timeline!");
+        }
+        return reached(point);
+    }
+
+    // Everything handed out so far, on every lane.
+    void waitIdle()
+    {
+        for (uint32_t i = 0; i < static_cast<uint32_t>(Lane::Count); i++)
+        {
+            wait(last(static_cast<Lane>(i)));
+        }
+    }
+
+private:
+    struct PendingFence
+    {
+        uint64_t value;
+        VkFence fence;
+    };
+
+    // Host waits blocked on a fence, and whether refresh() saw it finish meanwhile.
+    struct FenceWaiters
+    {
+        uint32_t count = 0;
+        bool finished = false;
+    };
+
+    struct LaneState
+    {
+        VkSemaphore semaphore = VK_NULL_HANDLE;
+        uint64_t submitted = 0;
+        std::atomic<uint64_t> completed{0};
+        // Without timeline semaphores, the fences of the submits not seen finished yet.
+        std::deque<PendingFence> pending;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    bool timelineSemaphores = false;
+    PFN_vkWaitSemaphoresKHR waitSemaphores = nullptr;
+    PFN_vkGetSemaphoreCounterValueKHR getCounterValue = nullptr;
+    LaneState lanes[static_cast<uint32_t>(Lane::Count)];
+    std::vector<VkFence> freeFences;
+    std::map<VkFence, FenceWaiters> waitedFences;
+    mutable std::mutex mutex;
+    std::atomic<uint64_t> hostWaits{0};
+
+    static uint32_t index(Lane lane)
+    {
+        return static_cast<uint32_t>(lane);
+    }
+
+    void refresh(Lane lane)
+    {
+        LaneState &state = lanes[index(lane)];
+        if (timelineSemaphores)
+        {
+            uint64_t value = 0;
+            if (getCounterValue(device, state.semaphore, &value) == VK_SUCCESS)
+            {
+                state.completed.store(value, std::memory_order_release);
+            }
+            return;
+        }
+
+        // Submits of a lane finish in order, only the oldest fences matter.
+        std::lock_guard<std::mutex> guard(mutex);
+        while (!state.pending.empty() && vkGetFenceStatus(device, state.pending.front().fence) == VK_SUCCESS)
+        {
+            PendingFence done = state.pending.front();
+            state.pending.pop_front();
+            auto waited = waitedFences.find(done.fence);
+            if (waited != waitedFences.end())
+            {
+                waited->second.finished = true;
+            }
+            else
+            {
+                vkResetFences(device, 1, &done.fence);
+                freeFences.push_back(done.fence);
+            }
+            state.completed.store(done.value, std::memory_order_release);
+        }
+    }
+};
+
+// 109 - Vulkan objects replaced at runtime (an old swap chain, a streamed out
+// buffer) that the GPU may still be using. Each one waits for the timeline
+// point of its last use and is destroyed by collect() once the frame slot
+// wait shows the GPU passed it, so nothing ever drains the GPU to replace a
+// resource. Entries are kept per lane in the order they were deferred:
+// values on a lane only go up, so collect() stops at the first unreached one.
+//
+// defer() can be called from any thread, collect() and flush() only from the
+// one that owns the frame loop.
+class DeletionQueue
+{
+public:
+    void init(GpuTimeline &gpuTimeline)
+    {
+        timeline = &gpuTimeline;
+    }
+
+    // Runs destroy once the GPU reached lastUse.
+    void defer(GpuTimeline::Point lastUse, std::function<void()> destroy)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        lanes[static_cast<uint32_t>(lastUse.lane)].push_back({lastUse.value, std::move(destroy)});
+        deferred++;
+    }
+
+    // Destroys everything whose point was reached. Never blocks on the GPU.
+    void collect()
+    {
+        for (uint32_t i = 0; i < static_cast<uint32_t>(GpuTimeline::Lane::Count); i++)
+        {
+            GpuTimeline::Lane lane = static_cast<GpuTimeline::Lane>(i);
+            while (true)
+            {
+                Entry entry;
+                {
+                    std::lock_guard<std::mutex> guard(mutex);
+                    if (lanes[i].empty() || !timeline->reached({lane, lanes[i].front().value}))
+                    {
+                        break;
+                    }
+                    entry = std::move(lanes[i].front());
+                    lanes[i].pop_front();
+                }
+                // Outside the lock, destroying may defer something else.
+                entry.destroy();
+                destroyed++;
+            }
+        }
+    }
+
+    // Destroys everything left. The GPU has to be idle.
+    void flush()
+    {
+        uint64_t left = 0;
+        for (auto &entries : lanes)
+        {
+            while (!entries.empty())
+            {
+                Entry entry = std::move(entries.front());
+                entries.pop_front();
+                entry.destroy();
+                left++;
+            }
+        }
+        if (deferred > 0)
+        {
+            BINI_LOG(Info, Render, "Deletion queue: " + std::to_string(deferred) + " deferred, " + std::to_string(destroyed) +
+                                   " destroyed while running, " + std::to_string(left) + " at shutdown");
+        }
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t value = 0;
+        std::function<void()> destroy;
+    };
+
+    GpuTimeline *timeline = nullptr;
+    std::deque<Entry> lanes[static_cast<uint32_t>(GpuTimeline::Lane::Count)];
+    std::mutex mutex;
+    uint64_t deferred = 0;
+    uint64_t destroyed = 0;
+};
+
+// 75 - Upload path from the CPU to device local memory. One persistently
+// mapped host buffer used as a ring: copies are written at the head, recorded
+// into the current batch and submitted together. Every submitted batch signals
+// a point on the transfer lane of the GPU timeline, once it's reached its part
+// of the ring is free again. The CPU only waits when the ring is full.
+//
+// Destinations used by another queue family than the ring's one have to be
+// created with VK_SHARING_MODE_CONCURRENT, there is no ownership transfer.
+class StagingRing
+{
+public:
+    static constexpr VkDeviceSize DEFAULT_SIZE = 32ull * 1024 * 1024;
+    // Covers the texel size of every format we use and the 4 bytes transfer
+    // queues need for buffer to image copies.
+    static constexpr VkDeviceSize COPY_ALIGNMENT = 16;
+
+    void init(VkDevice logicalDevice, DeviceMemoryAllocator &memoryAllocator, GpuTimeline &gpuTimeline, PriorityQueue &submitQueue,
+              uint32_t queueFamily, VkDeviceSize size = DEFAULT_SIZE)
+    {
+        device = logicalDevice;
+        allocator = &memoryAllocator;
+        timeline = &gpuTimeline;
+        queue = &submitQueue;
+        capacity = size;
+
+        VkBufferCreateInfo bufferInfo{};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = capacity;
+        bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create staging buffer!");
+        }
+        // Coherent, so writing through the pointer is all it takes.
+        memory = allocator->allocateForBuffer(buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        mapped = static_cast<char *>(memory.mapped);
+
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        poolInfo.queueFamilyIndex = queueFamily;
+        if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create staging command pool!");
+        }
+    }
+
+    void cleanup()
+    {
+        waitIdle();
+        freeBatches.clear();
+        vkDestroyCommandPool(device, commandPool, nullptr);
+        vkDestroyBuffer(device, buffer, nullptr);
+        allocator->free(memory);
+    }
+
+    // Big uploads go in pieces, each piece waits for ring space if it must.
+    void uploadToBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void *data, VkDeviceSize size)
+    {
+        const char *source = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            VkDeviceSize chunk = std::min(size, capacity);
+            VkDeviceSize offset = reserve(chunk);
+            std::memcpy(mapped + offset, source, static_cast<size_t>(chunk));
+
+            VkBufferCopy region{};
+            region.srcOffset = offset;
+            region.dstOffset = dstOffset;
+            region.size = chunk;
+            vkCmdCopyBuffer(current.commandBuffer, buffer, dst, 1, &region);
+
+            source += chunk;
+            dstOffset += chunk;
+            size -= chunk;
+            uploadedBytes += chunk;
+        }
+    }
+
+    // Whole image upload of a single mip level, tightly packed data. The image
+    // ends in finalLayout.
+    void uploadToImage(VkImage dst, VkExtent3D extent, const void *data, VkDeviceSize size, VkImageLayout finalLayout)
+    {
+        if (size > capacity)
+        {
+            throw std::runtime_error("Image upload of " + std::to_string(size) + " bytes doesn't fit in the staging ring!");
+        }
+        VkDeviceSize offset = reserve(size);
+        std::memcpy(mapped + offset, data, static_cast<size_t>(size));
+
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = dst;
+        barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+        vkCmdPipelineBarrier(current.commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                             0, nullptr, 0, nullptr, 1, &barrier);
+
+        VkBufferImageCopy region{};
+        region.bufferOffset = offset;
+        region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+        region.imageExtent = extent;
+        vkCmdCopyBufferToImage(current.commandBuffer, buffer, dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+        // Whoever uses the image waits for the batch (timeline or semaphore),
+        // that wait makes the copy visible, so nothing to add on the dst side.
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = finalLayout;
+        vkCmdPipelineBarrier(current.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+                             0, nullptr, 0, nullptr, 1, &barrier);
+        uploadedBytes += size;
+    }
+
+    // Submit everything recorded so far. The semaphore (optional) lets another
+    // queue wait for these uploads without the CPU in the middle, it covers
+    // the earlier submits of the ring too. False when there was nothing to
+    // submit, the semaphore isn't signaled then.
+    bool flush(VkSemaphore signalSemaphore = VK_NULL_HANDLE)
+    {
+        retireFinished();
+        if (!recording)
+        {
+            return false;
+        }
+        CPU_ZONE("staging flush");
+        if (vkEndCommandBuffer(current.commandBuffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to record staging commands!");
+        }
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &current.commandBuffer;
+        GpuTimeline::Submit sync;
+        if (signalSemaphore != VK_NULL_HANDLE)
+        {
+            sync.signal(signalSemaphore);
+        }
+        timeline->prepare(GpuTimeline::Lane::Transfer, sync);
+        sync.fill(submitInfo);
+
+        VkResult result;
+        {
+            std::lock_guard<std::mutex> lock(*queue->lock);
+            result = vkQueueSubmit(queue->queue, 1, &submitInfo, sync.fence);
+        }
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to submit staging commands!");
+        }
+        current.done = sync.point;
+        lastSubmitted = sync.point;
+        inFlight.push_back(current);
+        recording = false;
+        return true;
+    }
+
+    // Submit and wait until every upload landed.
+    void waitIdle()
+    {
+        flush();
+        if (!inFlight.empty())
+        {
+            timeline->wait(inFlight.back().done);
+            retireFinished();
+        }
+    }
+
+    // Reached once every upload submitted so far landed, for other queues to wait on.
+    GpuTimeline::Point lastUpload() const
+    {
+        return lastSubmitted;
+    }
+
+    uint64_t bytesUploaded() const
+    {
+        return uploadedBytes;
+    }
+
+private:
+    struct Batch
+    {
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        GpuTimeline::Point done;
+        // Ring bytes this batch holds, alignment and wrap around included.
+        VkDeviceSize ringBytes = 0;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    DeviceMemoryAllocator *allocator = nullptr;
+    GpuTimeline *timeline = nullptr;
+    PriorityQueue *queue = nullptr;
+    VkCommandPool commandPool = VK_NULL_HANDLE;
+
+    VkBuffer buffer = VK_NULL_HANDLE;
+    MemoryAllocation memory;
+    char *mapped = nullptr;
+    VkDeviceSize capacity = 0;
+    VkDeviceSize head = 0;
+    VkDeviceSize used = 0;
+    uint64_t uploadedBytes = 0;
+
+    Batch current;
+    bool recording = false;
+    GpuTimeline::Point lastSubmitted{GpuTimeline::Lane::Transfer, 0};
+    std::deque<Batch> inFlight;
+    std::vector<Batch> freeBatches;
+
+    // Batches finish in submission order, so we only look at the oldest ones.
+    void retireFinished()
+    {
+        while (!inFlight.empty() && timeline->reached(inFlight.front().done))
+        {
+            Batch batch = inFlight.front();
+            inFlight.pop_front();
+            used -= batch.ringBytes;
+            batch.ringBytes = 0;
+            vkResetCommandBuffer(batch.commandBuffer, 0);
+            freeBatches.push_back(batch);
+        }
+        if (used == 0)
+        {
+            // Empty ring, start from the beginning so we don't wrap early.
+            head = 0;
+        }
+    }
+
+    // Space for size bytes at the head of the ring, inside the current batch.
+    VkDeviceSize reserve(VkDeviceSize size)
+    {
+        while (true)
+        {
+            VkDeviceSize offset = (head + COPY_ALIGNMENT - 1) / COPY_ALIGNMENT * COPY_ALIGNMENT;
+            VkDeviceSize needed = offset - head + size;
+            if (offset + size > capacity)
+            {
+                // Doesn't fit before the end, the tail of the ring is skipped.
+                offset = 0;
+                needed = capacity - head + size;
+            }
+            if (used + needed <= capacity)
+            {
+                beginBatch();
+                head = offset + size;
+                used += needed;
+                current.ringBytes += needed;
+                return offset;
+            }
+
+            // Full: submit what we have so it can finish and wait for the oldest batch.
+            flush();
+            if (inFlight.empty())
+            {
+                throw std::runtime_error("Staging ring is full and nothing is in flight!");
+            }
+            timeline->wait(inFlight.front().done);
+            retireFinished();
+        }
+    }
+
+    void beginBatch()
+    {
+        if (recording)
+        {
+            return;
+        }
+        if (!freeBatches.empty())
+        {
+            current = freeBatches.back();
+            freeBatches.pop_back();
+        }
+        else
+        {
+            current = Batch{};
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = commandPool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = 1;
+            if (vkAllocateCommandBuffers(device, &allocInfo, &current.commandBuffer) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to allocate staging command buffer!");
+            }
+        }
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginCommandBuffer(current.commandBuffer, &beginInfo);
+        recording = true;
+    }
+};
+
+// 78 - Records secondary command buffers on worker threads. Command pools
+// can't be used by two threads at once, so every worker owns one pool per
+// frame in flight: it resets its pool when the slot comes around again and
+// nobody ever waits on a lock to record. The primary command buffer runs
+// the results with vkCmdExecuteCommands.
+class ParallelRecorder
+{
+public:
+    // Records items [first, first + count) into the given secondary.
+    using RecordFunction = std::function<void(VkCommandBuffer, uint32_t, uint32_t)>;
+
+    void init(VkDevice logicalDevice, uint32_t queueFamily, uint32_t threadCount, uint32_t framesInFlight)
+    {
+        device = logicalDevice;
+        workers.resize(threadCount);
+        recorded.resize(threadCount);
+        for (auto &worker : workers)
+        {
+            worker.pools.resize(framesInFlight);
+            worker.commandBuffers.resize(framesInFlight);
+            for (uint32_t slot = 0; slot < framesInFlight; slot++)
+            {
+                VkCommandPoolCreateInfo poolInfo{};
+                poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+                poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+                poolInfo.queueFamilyIndex = queueFamily;
+                if (vkCreateCommandPool(device, &poolInfo, nullptr, &worker.pools[slot]) != VK_SUCCESS)
+                {
+                    throw std::runtime_error("Failed to create worker command pool!");
+                }
+
+                VkCommandBufferAllocateInfo allocInfo{};
+                allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+                allocInfo.commandPool = worker.pools[slot];
+                allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+                allocInfo.commandBufferCount = 1;
+                if (vkAllocateCommandBuffers(device, &allocInfo, &worker.commandBuffers[slot]) != VK_SUCCESS)
+                {
+                    throw std::runtime_error("Failed to allocate secondary command buffer!");
+                }
+            }
+        }
+        // Threads start last, everything they touch exists by now.
+        for (uint32_t i = 0; i < threadCount; i++)
+        {
+            workers[i].thread = std::thread(&ParallelRecorder::workerLoop, this, i);
+        }
+    }
+
+    void cleanup()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+        {
+            if (worker.thread.joinable())
+            {
+                worker.thread.join();
+            }
+            // Destroying the pools frees their command buffers too.
+            for (auto pool : worker.pools)
+            {
+                vkDestroyCommandPool(device, pool, nullptr);
+            }
+        }
+        workers.clear();
+    }
+
+    // Split the items evenly over the workers and wait for all of them. The
+    // slot's previous work has to be finished on the GPU (its timeline point reached).
+    // Returns the secondaries in item order, workers without items are left out.
+    // With inheritance they are meant to run inside that render pass / rendering.
+    const std::vector<VkCommandBuffer> &record(uint32_t frameSlot, uint32_t itemCount, const RecordFunction &function,
+                                               const VkCommandBufferInheritanceInfo *inheritance = nullptr)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobSlot = frameSlot;
+            jobItems = itemCount;
+            jobFunction = &function;
+            jobInheritance = inheritance;
+            pending = static_cast<uint32_t>(workers.size());
+            generation++;
+        }
+        wake.notify_all();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this]
+                      { return pending == 0; });
+        }
+        if (failure)
+        {
+            std::rethrow_exception(std::exchange(failure, nullptr));
+        }
+
+        result.clear();
+        for (auto commandBuffer : recorded)
+        {
+            if (commandBuffer != VK_NULL_HANDLE)
+            {
+                result.push_back(commandBuffer);
+            }
+        }
+        return result;
+    }
+
+    uint32_t threadCount() const
+    {
+        return static_cast<uint32_t>(workers.size());
+    }
+
+private:
+    struct Worker
+    {
+        std::thread thread;
+        // One pool and its secondary per frame in flight.
+        std::vector<VkCommandPool> pools;
+        std::vector<VkCommandBuffer> commandBuffers;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    std::vector<Worker> workers;
+
+    // Job handed to the workers, guarded by the mutex. A new generation
+    // means a new job.
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    uint64_t generation = 0;
+    uint32_t pending = 0;
+    bool stopping = false;
+    uint32_t jobSlot = 0;
+    uint32_t jobItems = 0;
+    const RecordFunction *jobFunction = nullptr;
+    const VkCommandBufferInheritanceInfo *jobInheritance = nullptr;
+    std::exception_ptr failure;
+
+    // What each worker recorded for the current job, by worker index.
+    std::vector<VkCommandBuffer> recorded;
+    std::vector<VkCommandBuffer> result;
+
+    void workerLoop(uint32_t index)
+    {
+        uint64_t seenGeneration = 0;
+        while (true)
+        {
+            uint32_t slot, items;
+            const RecordFunction *function;
+            const VkCommandBufferInheritanceInfo *inheritance;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]
+                          { return stopping || generation != seenGeneration; });
+                if (stopping)
+                {
+                    return;
+                }
+                seenGeneration = generation;
+                slot = jobSlot;
+                items = jobItems;
+                function = jobFunction;
+                inheritance = jobInheritance;
+            }
+
+            uint32_t count = static_cast<uint32_t>(workers.size());
+            uint32_t first = static_cast<uint32_t>(static_cast<uint64_t>(items) * index / count);
+            uint32_t last = static_cast<uint32_t>(static_cast<uint64_t>(items) * (index + 1) / count);
+            recorded[index] = VK_NULL_HANDLE;
+            try
+            {
+                if (last > first)
+                {
+                    recorded[index] = recordRange(workers[index], slot, first, last - first, *function, inheritance);
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                failure = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending--;
+            }
+            done.notify_one();
+        }
+    }
+
+    VkCommandBuffer recordRange(Worker &worker, uint32_t slot, uint32_t first, uint32_t count, const RecordFunction &function,
+                                const VkCommandBufferInheritanceInfo *inheritance)
+    {
+        CPU_ZONE("record secondary");
+        // Only this thread uses the pool, so the reset needs no lock.
+        vkResetCommandPool(device, worker.pools[slot], 0);
+        VkCommandBuffer commandBuffer = worker.commandBuffers[slot];
+
+        // Executed outside of a render pass there is nothing to inherit.
+        VkCommandBufferInheritanceInfo noInheritance{};
+        noInheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        beginInfo.pInheritanceInfo = &noInheritance;
+        if (inheritance != nullptr)
+        {
+            beginInfo.flags |= VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+            beginInfo.pInheritanceInfo = inheritance;
+        }
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to begin recording secondary command buffer!");
+        }
+        function(commandBuffer, first, count);
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to record secondary command buffer!");
+        }
+        return commandBuffer;
+    }
+};
+
+// 87 - GPU time of every pass through timestamp queries. Each frame slot has
+// its own query pool, its results are read when the slot comes around again:
+// by then its submit was waited for and the results are there, so reading them
+// never stalls.
+class GpuProfiler
+{
+public:
+    static constexpr uint32_t MAX_SCOPES = 64;
+    // Samples kept per scope for min, average and 99th percentile.
+    static constexpr size_t HISTORY = 512;
+
+    struct Timing
+    {
+        std::string name;
+        double minMs = 0.0;
+        double avgMs = 0.0;
+        double p99Ms = 0.0;
+        size_t samples = 0;
+    };
+
+    void init(VkPhysicalDevice physicalDevice, VkDevice logicalDevice, uint32_t queueFamily, uint32_t framesInFlight)
+    {
+        device = logicalDevice;
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        uint32_t familyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> families(familyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, families.data());
+
+        uint32_t validBits = families[queueFamily].timestampValidBits;
+        if (validBits == 0)
+        {
+            BINI_LOG(Warning, Profiler, "The graphics queue has no timestamps, GPU profiling is off.");
+            return;
+        }
+        // Nanoseconds per tick, and only the low validBits of a timestamp count.
+        timestampPeriod = properties.limits.timestampPeriod;
+        timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+        slots.resize(framesInFlight);
+        for (auto &slot : slots)
+        {
+            VkQueryPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+            poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+            poolInfo.queryCount = MAX_SCOPES * 2;
+            if (vkCreateQueryPool(device, &poolInfo, nullptr, &slot.pool) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create timestamp query pool!");
+            }
+        }
+    }
+
+    bool enabled() const
+    {
+        return !slots.empty();
+    }
+
+    void cleanup()
+    {
+        for (auto &slot : slots)
+        {
+            vkDestroyQueryPool(device, slot.pool, nullptr);
+        }
+        slots.clear();
+    }
+
+    // Read what the slot measured the last time it was used. Call after its
+    // submit was waited for and before recording into it again.
+    void collect(uint32_t slotIndex)
+    {
+        if (!enabled())
+        {
+            return;
+        }
+        Slot &slot = slots[slotIndex];
+        if (slot.queryCount == 0)
+        {
+            return;
+        }
+        std::vector<uint64_t> ticks(slot.queryCount);
+        VkResult result = vkGetQueryPoolResults(device, slot.pool, 0, slot.queryCount, ticks.size() * sizeof(uint64_t),
+                                                ticks.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+        if (result == VK_SUCCESS)
+        {
+            for (const auto &scope : slot.scopes)
+            {
+                uint64_t elapsed = ((ticks[scope.endQuery] - ticks[scope.beginQuery]) & timestampMask);
+                auto &history = histories[scope.name];
+                history.push_back(static_cast<double>(elapsed) * timestampPeriod / 1e6);
+                if (history.size() > HISTORY)
+                {
+                    history.pop_front();
+                }
+            }
+        }
+        slot.scopes.clear();
+        slot.queryCount = 0;
+    }
+
+    // First thing recorded for a slot, the queries are reset for this frame.
+    void beginFrame(VkCommandBuffer commandBuffer, uint32_t slotIndex)
+    {
+        if (!enabled())
+        {
+            return;
+        }
+        current = &slots[slotIndex];
+        vkCmdResetQueryPool(commandBuffer, current->pool, 0, MAX_SCOPES * 2);
+    }
+
+    // Scopes can nest, a scope over the whole submission holds the passes.
+    void beginScope(VkCommandBuffer commandBuffer, const std::string &name)
+    {
+        if (!enabled() || current->scopes.size() >= MAX_SCOPES)
+        {
+            openScopes.push_back(SIZE_MAX);
+            return;
+        }
+        Scope scope;
+        scope.name = name;
+        scope.beginQuery = current->queryCount++;
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, current->pool, scope.beginQuery);
+        openScopes.push_back(current->scopes.size());
+        current->scopes.push_back(scope);
+    }
+
+    void endScope(VkCommandBuffer commandBuffer)
+    {
+        size_t index = openScopes.back();
+        openScopes.pop_back();
+        if (index == SIZE_MAX)
+        {
+            return;
+        }
+        Scope &scope = current->scopes[index];
+        scope.endQuery = current->queryCount++;
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, current->pool, scope.endQuery);
+    }
+
+    std::vector<Timing> timings() const
+    {
+        std::vector<Timing> result;
+        for (const auto &entry : histories)
+        {
+            if (entry.second.empty())
+            {
+                continue;
+            }
+            std::vector<double> sorted(entry.second.begin(), entry.second.end());
+            std::sort(sorted.begin(), sorted.end());
+            Timing timing;
+            timing.name = entry.first;
+            timing.samples = sorted.size();
+            timing.minMs = sorted.front();
+            double total = 0.0;
+            for (double ms : sorted)
+            {
+                total += ms;
+            }
+            timing.avgMs = total / static_cast<double>(sorted.size());
+            timing.p99Ms = sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)];
+            result.push_back(timing);
+        }
+        // Most expensive first.
+        std::sort(result.begin(), result.end(), [](const Timing &a, const Timing &b)
+                  { return a.avgMs > b.avgMs; });
+        return result;
+    }
+
+    // One line for the window title: average GPU ms of the heaviest scopes.
+    std::string summary(size_t maxEntries) const
+    {
+        std::string text;
+        char buffer[128];
+        for (const auto &timing : timings())
+        {
+            if (maxEntries-- == 0)
+            {
+                break;
+            }
+            std::snprintf(buffer, sizeof(buffer), "%s%s %.3f ms", text.empty() ? "" : " | ", timing.name.c_str(), timing.avgMs);
+            text += buffer;
+        }
+        return text;
+    }
+
+    // CSV with one line per scope.
+    void dump(const std::string &path) const
+    {
+        std::ofstream file(path);
+        if (!file)
+        {
+            BINI_LOG(Warning, Profiler, "Couldn't write the GPU profile to " + path);
+            return;
+        }
+        file << "scope,samples,min_ms,avg_ms,p99_ms\n";
+        for (const auto &timing : timings())
+        {
+            file << timing.name << "," << timing.samples << "," << timing.minMs << "," << timing.avgMs << "," << timing.p99Ms << "\n";
+        }
+        BINI_LOG(Info, Profiler, "GPU profile written to " + path);
+    }
+
+private:
+    struct Scope
+    {
+        std::string name;
+        uint32_t beginQuery = 0;
+        uint32_t endQuery = 0;
+    };
+
+    struct Slot
+    {
+        VkQueryPool pool = VK_NULL_HANDLE;
+        uint32_t queryCount = 0;
+        std::vector<Scope> scopes;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    float timestampPeriod = 1.0f;
+    uint64_t timestampMask = ~0ull;
+    std::vector<Slot> slots;
+    Slot *current = nullptr;
+    std::vector<size_t> openScopes;
+    std::map<std::string, std::deque<double>> histories;
+};
+
+// 81 - How a pass uses a resource. Every usage knows its pipeline stage,
+// access and image layout, so passes never write barriers themselves.
+enum class ResourceUsage
+{
+    TransferSrc,
+    TransferDst,
+    ColorAttachment,
+    DepthAttachment,
+    FragmentSampled,
+    ComputeSampled,
+    ComputeStorageRead,
+    ComputeStorageWrite,
+    VertexBuffer,
+    IndexBuffer,
+    UniformBuffer,
+    // Only as the final usage of a swap chain image.
+    Present
+};
+
+struct UsageInfo
+{
+    VkPipelineStageFlags stage;
+    VkAccessFlags access;
+    VkImageLayout layout;
+    bool write;
+    // What the image or buffer has to be created with to allow the usage.
+    VkImageUsageFlags imageUsage;
+    VkBufferUsageFlags bufferUsage;
+};
+
+UsageInfo usageInfo(ResourceUsage usage)
+{
+    switch (usage)
+    {
+    case ResourceUsage::TransferSrc:
+        return {VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, false,
+                VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_BUFFER_USAGE_TRANSFER_SRC_BIT};
+    case ResourceUsage::TransferDst:
+        return {VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, true,
+                VK_IMAGE_USAGE_TRANSFER_DST_BIT, VK_BUFFER_USAGE_TRANSFER_DST_BIT};
+    case ResourceUsage::ColorAttachment:
+        return {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, true, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, 0};
+    case ResourceUsage::DepthAttachment:
+        return {VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, true, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, 0};
+    case ResourceUsage::FragmentSampled:
+        return {VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false,
+                VK_IMAGE_USAGE_SAMPLED_BIT, VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT};
+    case ResourceUsage::ComputeSampled:
+        return {VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false,
+                VK_IMAGE_USAGE_SAMPLED_BIT, VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT};
+    case ResourceUsage::ComputeStorageRead:
+        return {VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_GENERAL, false,
+                VK_IMAGE_USAGE_STORAGE_BIT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT};
+    case ResourceUsage::ComputeStorageWrite:
+        return {VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL, true,
+                VK_IMAGE_USAGE_STORAGE_BIT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT};
+    case ResourceUsage::VertexBuffer:
+        return {VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, VK_IMAGE_LAYOUT_UNDEFINED, false,
+                0, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT};
+    case ResourceUsage::IndexBuffer:
+        return {VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_INDEX_READ_BIT, VK_IMAGE_LAYOUT_UNDEFINED, false,
+                0, VK_BUFFER_USAGE_INDEX_BUFFER_BIT};
+    case ResourceUsage::UniformBuffer:
+        return {VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_UNIFORM_READ_BIT,
+                VK_IMAGE_LAYOUT_UNDEFINED, false, 0, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT};
+    case ResourceUsage::Present:
+        // The semaphore given to vkQueuePresentKHR does the waiting.
+        return {VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, false, 0, 0};
+    }
+    throw std::runtime_error("Unknown resource usage!");
+}
+
+// 82 - Frame described as passes that declare what they read and write.
+// compile() drops passes nothing depends on and works out every barrier and
+// layout transition once; execute() records the passes with one batched
+// vkCmdPipelineBarrier in front of each pass that needs one.
+//
+// Imported resources live outside the graph (swap chain images), their
+// handle can change every frame. Transient ones are created by the graph
+// with the usage flags of everything the passes do with them.
+class RenderGraph
+{
+public:
+    using Resource = uint32_t;
+    using PassFunction = std::function<void(VkCommandBuffer, const RenderGraph &)>;
+
+    struct ImageDesc
+    {
+        VkFormat format = VK_FORMAT_B8G8R8A8_UNORM;
+        VkExtent2D extent = {0, 0};
+    };
+
+    void init(VkDevice logicalDevice, DeviceMemoryAllocator &memoryAllocator)
+    {
+        device = logicalDevice;
+        allocator = &memoryAllocator;
+    }
+
+    // Destroys the transient resources, the graph can be built again after.
+    void reset()
+    {
+        for (auto &resource : resources)
+        {
+            if (!resource.imported && (resource.image != VK_NULL_HANDLE || resource.buffer != VK_NULL_HANDLE))
+            {
+                if (resource.isImage)
+                {
+                    vkDestroyImage(device, resource.image, nullptr);
+                }
+                else
+                {
+                    vkDestroyBuffer(device, resource.buffer, nullptr);
+                }
+                allocator->free(resource.memory);
+            }
+        }
+        for (auto &heap : heaps)
+        {
+            allocator->free(heap.memory);
+        }
+        heaps.clear();
+        resources.clear();
+        passes.clear();
+        steps.clear();
+        finalBarriers = BarrierBatch{};
+    }
+
+    // The content of an imported image is thrown away every frame when its
+    // layout is UNDEFINED, like a swap chain image we just acquired. The first
+    // barrier waits for initialStages, for a swap chain image those are the
+    // stages the submit waits for the acquire semaphore at.
+    Resource importImage(const std::string &name, VkImageAspectFlags aspect, VkImageLayout initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+                         VkPipelineStageFlags initialStages = 0)
+    {
+        ResourceNode node;
+        node.name = name;
+        node.isImage = true;
+        node.imported = true;
+        node.aspect = aspect;
+        node.initialLayout = initialLayout;
+        node.initialStages = initialStages;
+        resources.push_back(node);
+        return static_cast<Resource>(resources.size() - 1);
+    }
+
+    Resource importBuffer(const std::string &name)
+    {
+        ResourceNode node;
+        node.name = name;
+        node.imported = true;
+        resources.push_back(node);
+        return static_cast<Resource>(resources.size() - 1);
+    }
+
+    Resource createImage(const std::string &name, const ImageDesc &desc)
+    {
+        ResourceNode node;
+        node.name = name;
+        node.isImage = true;
+        node.imageDesc = desc;
+        node.aspect = isDepthFormat(desc.format) ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
+        resources.push_back(node);
+        return static_cast<Resource>(resources.size() - 1);
+    }
+
+    Resource createBuffer(const std::string &name, VkDeviceSize size)
+    {
+        ResourceNode node;
+        node.name = name;
+        node.bufferSize = size;
+        resources.push_back(node);
+        return static_cast<Resource>(resources.size() - 1);
+    }
+
+    // Passes run in the order they are added. Every resource the function
+    // touches has to be declared in accesses.
+    void addPass(const std::string &name, std::vector<std::pair<Resource, ResourceUsage>> accesses, PassFunction function)
+    {
+        Pass pass;
+        pass.name = name;
+        pass.accesses = std::move(accesses);
+        pass.function = std::move(function);
+        passes.push_back(std::move(pass));
+    }
+
+    // What leaves the graph and how it is used after the frame. Only passes
+    // that end up in an output survive compile().
+    void setOutput(Resource resource, ResourceUsage finalUsage)
+    {
+        resources[resource].output = true;
+        resources[resource].finalUsage = finalUsage;
+    }
+
+    void compile()
+    {
+        cullPasses();
+        computeLifetimes();
+        createTransients();
+        computeBarriers();
+
+        uint32_t culled = 0;
+        uint32_t barrierCount = static_cast<uint32_t>(finalBarriers.barriers.size());
+        for (const auto &pass : passes)
+        {
+            culled += pass.culled ? 1 : 0;
+        }
+        for (const auto &step : steps)
+        {
+            barrierCount += static_cast<uint32_t>(step.before.barriers.size());
+        }
+        BINI_LOG(Info, Render, "Render graph: " + std::to_string(passes.size()) + " passes, " + std::to_string(culled) +
+                               " culled, " + std::to_string(barrierCount) + " barriers");
+    }
+
+    void setImportedImage(Resource resource, VkImage image)
+    {
+        resources[resource].image = image;
+    }
+
+    void setImportedBuffer(Resource resource, VkBuffer buffer)
+    {
+        resources[resource].buffer = buffer;
+    }
+
+    VkImage image(Resource resource) const
+    {
+        return resources[resource].image;
+    }
+
+    VkBuffer buffer(Resource resource) const
+    {
+        return resources[resource].buffer;
+    }
+
+    // Memory the transients take, and what they would take without aliasing.
+    VkDeviceSize transientMemory() const
+    {
+        return aliasedBytes;
+    }
+
+    VkDeviceSize transientMemoryWithoutAliasing() const
+    {
+        return transientBytes;
+    }
+
+    // Every pass is timed when a profiler is given, its barriers included.
+    void execute(VkCommandBuffer commandBuffer, GpuProfiler *profiler = nullptr) const
+    {
+        for (const auto &step : steps)
+        {
+            if (profiler)
+            {
+                profiler->beginScope(commandBuffer, passes[step.pass].name);
+            }
+            recordBarriers(commandBuffer, step.before);
+            passes[step.pass].function(commandBuffer, *this);
+            if (profiler)
+            {
+                profiler->endScope(commandBuffer);
+            }
+        }
+        recordBarriers(commandBuffer, finalBarriers);
+    }
+
+private:
+    struct ResourceNode
+    {
+        std::string name;
+        bool isImage = false;
+        bool imported = false;
+        bool output = false;
+        ResourceUsage finalUsage = ResourceUsage::TransferSrc;
+
+        VkImageAspectFlags aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+        VkImageLayout initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        VkPipelineStageFlags initialStages = 0;
+        ImageDesc imageDesc;
+        VkDeviceSize bufferSize = 0;
+
+        VkImage image = VK_NULL_HANDLE;
+        VkBuffer buffer = VK_NULL_HANDLE;
+        VkMemoryRequirements requirements{};
+        // Lazily allocated memory of its own, otherwise a place in an alias heap.
+        bool lazy = false;
+        MemoryAllocation memory;
+        uint32_t heap = 0;
+        VkDeviceSize heapOffset = 0;
+        // Transients that use some of the same memory at other times.
+        std::vector<Resource> aliases;
+    };
+
+    struct Lifetime
+    {
+        bool used = false;
+        uint32_t first = 0;
+        uint32_t last = 0;
+        // What the last step using the resource did with it.
+        VkPipelineStageFlags lastStages = 0;
+        VkAccessFlags lastWriteAccess = 0;
+        VkImageUsageFlags imageUsage = 0;
+        VkBufferUsageFlags bufferUsage = 0;
+    };
+
+    // One allocation shared by transients that are never alive together.
+    struct AliasHeap
+    {
+        bool images = false;
+        uint32_t memoryTypeBits = 0;
+        VkDeviceSize size = 0;
+        VkDeviceSize alignment = 1;
+        std::vector<Resource> resources;
+        MemoryAllocation memory;
+    };
+
+    struct Pass
+    {
+        std::string name;
+        std::vector<std::pair<Resource, ResourceUsage>> accesses;
+        PassFunction function;
+        bool culled = false;
+    };
+
+    struct Barrier
+    {
+        Resource resource;
+        VkAccessFlags srcAccess;
+        VkAccessFlags dstAccess;
+        VkImageLayout oldLayout;
+        VkImageLayout newLayout;
+    };
+
+    // Everything one vkCmdPipelineBarrier does.
+    struct BarrierBatch
+    {
+        VkPipelineStageFlags srcStages = 0;
+        VkPipelineStageFlags dstStages = 0;
+        std::vector<Barrier> barriers;
+    };
+
+    struct Step
+    {
+        uint32_t pass;
+        BarrierBatch before;
+    };
+
+    // Where a resource is at some point of the frame while compiling.
+    struct ResourceState
+    {
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        // Last write (or layout transition) and the stages that already saw it.
+        VkPipelineStageFlags writeStages = 0;
+        VkAccessFlags writeAccess = 0;
+        VkPipelineStageFlags readStages = 0;
+        VkAccessFlags readAccess = 0;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    DeviceMemoryAllocator *allocator = nullptr;
+    std::vector<ResourceNode> resources;
+    std::vector<Pass> passes;
+    std::vector<Step> steps;
+    BarrierBatch finalBarriers;
+    std::vector<Lifetime> lifetimes;
+    std::vector<AliasHeap> heaps;
+    VkDeviceSize transientBytes = 0;
+    VkDeviceSize aliasedBytes = 0;
+
+    static bool isDepthFormat(VkFormat format)
+    {
+        return format == VK_FORMAT_D16_UNORM || format == VK_FORMAT_D32_SFLOAT || format == VK_FORMAT_D24_UNORM_S8_UINT ||
+               format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+    }
+
+    // Walk back from the outputs: a pass is needed when it writes something
+    // that is an output or that a needed pass reads.
+    void cullPasses()
+    {
+        std::vector<bool> needed(resources.size(), false);
+        for (size_t i = 0; i < resources.size(); i++)
+        {
+            needed[i] = resources[i].output;
+        }
+        for (size_t i = passes.size(); i-- > 0;)
+        {
+            Pass &pass = passes[i];
+            pass.culled = true;
+            for (const auto &access : pass.accesses)
+            {
+                if (usageInfo(access.second).write && needed[access.first])
+                {
+                    pass.culled = false;
+                }
+            }
+            if (pass.culled)
+            {
+                BINI_LOG(Debug, Render, "Render graph: culled pass " + pass.name);
+                continue;
+            }
+            for (const auto &access : pass.accesses)
+            {
+                if (!usageInfo(access.second).write)
+                {
+                    needed[access.first] = true;
+                }
+            }
+        }
+    }
+
+    // First and last step (surviving pass) using each resource, and what the
+    // last use did so the next user of the same memory knows what to wait for.
+    void computeLifetimes()
+    {
+        lifetimes.assign(resources.size(), Lifetime{});
+        uint32_t step = 0;
+        for (const auto &pass : passes)
+        {
+            if (pass.culled)
+            {
+                continue;
+            }
+            for (const auto &access : pass.accesses)
+            {
+                Lifetime &lifetime = lifetimes[access.first];
+                UsageInfo info = usageInfo(access.second);
+                if (!lifetime.used)
+                {
+                    lifetime.used = true;
+                    lifetime.first = step;
+                }
+                if (lifetime.last != step)
+                {
+                    lifetime.lastStages = 0;
+                    lifetime.lastWriteAccess = 0;
+                }
+                lifetime.last = step;
+                lifetime.lastStages |= info.stage;
+                lifetime.lastWriteAccess |= info.write ? info.access : 0;
+                lifetime.imageUsage |= info.imageUsage;
+                lifetime.bufferUsage |= info.bufferUsage;
+            }
+            step++;
+        }
+    }
+
+    void createImage(ResourceNode &resource, VkImageUsageFlags usage)
+    {
+        VkImageCreateInfo imageInfo{};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageInfo.format = resource.imageDesc.format;
+        imageInfo.extent = {resource.imageDesc.extent.width, resource.imageDesc.extent.height, 1};
+        imageInfo.mipLevels = 1;
+        imageInfo.arrayLayers = 1;
+        imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageInfo.usage = usage;
+        imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        if (vkCreateImage(device, &imageInfo, nullptr, &resource.image) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create render graph image " + resource.name + "!");
+        }
+        vkGetImageMemoryRequirements(device, resource.image, &resource.requirements);
+    }
+
+    // 85 - Transients whose lifetimes don't overlap share memory. Every
+    // resource gets the lowest offset in its heap that no resource alive at
+    // the same time uses, biggest resources first. Attachment only images go
+    // to lazily allocated memory when the device has it (tilers), those may
+    // never get physical memory at all.
+    void createTransients()
+    {
+        transientBytes = 0;
+        aliasedBytes = 0;
+        bool lazyMemory = allocator->hasMemoryType(~0u, VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+        const VkImageUsageFlags attachmentUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                                                  VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+
+        std::vector<Resource> aliasable;
+        for (uint32_t i = 0; i < resources.size(); i++)
+        {
+            ResourceNode &resource = resources[i];
+            const Lifetime &lifetime = lifetimes[i];
+            if (resource.imported || !lifetime.used)
+            {
+                continue;
+            }
+
+            bool lazy = false;
+            if (resource.isImage)
+            {
+                lazy = lazyMemory && (lifetime.imageUsage & ~attachmentUsage) == 0;
+                createImage(resource, lifetime.imageUsage | (lazy ? VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT : 0));
+                // The device has lazy memory, but maybe not for this image.
+                if (lazy && !allocator->hasMemoryType(resource.requirements.memoryTypeBits, VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT))
+                {
+                    vkDestroyImage(device, resource.image, nullptr);
+                    createImage(resource, lifetime.imageUsage);
+                    lazy = false;
+                }
+            }
+            else
+            {
+                VkBufferCreateInfo bufferInfo{};
+                bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+                bufferInfo.size = resource.bufferSize;
+                bufferInfo.usage = lifetime.bufferUsage;
+                bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+                if (vkCreateBuffer(device, &bufferInfo, nullptr, &resource.buffer) != VK_SUCCESS)
+                {
+                    throw std::runtime_error("Failed to create render graph buffer " + resource.name + "!");
+                }
+                vkGetBufferMemoryRequirements(device, resource.buffer, &resource.requirements);
+            }
+            transientBytes += resource.requirements.size;
+
+            if (lazy)
+            {
+                // Lazily allocated memory is only for attachments, never aliased.
+                resource.memory = allocator->allocateForImage(resource.image, VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+                resource.lazy = true;
+                continue;
+            }
+            aliasable.push_back(i);
+        }
+
+        std::sort(aliasable.begin(), aliasable.end(), [this](Resource a, Resource b)
+                  { return resources[a].requirements.size > resources[b].requirements.size; });
+        for (Resource index : aliasable)
+        {
+            placeInHeap(index);
+        }
+
+        // One allocation per heap, everything in it is bound at its offset.
+        for (auto &heap : heaps)
+        {
+            VkMemoryRequirements requirements{heap.size, heap.alignment, heap.memoryTypeBits};
+            heap.memory = allocator->allocate(requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                              heap.images ? ResourceKind::OptimalImage : ResourceKind::Linear);
+            aliasedBytes += heap.size;
+        }
+        for (Resource index : aliasable)
+        {
+            ResourceNode &resource = resources[index];
+            const MemoryAllocation &memory = heaps[resource.heap].memory;
+            VkResult result = resource.isImage ? vkBindImageMemory(device, resource.image, memory.memory, memory.offset + resource.heapOffset)
+                                               : vkBindBufferMemory(device, resource.buffer, memory.memory, memory.offset + resource.heapOffset);
+            if (result != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to bind render graph memory for " + resource.name + "!");
+            }
+        }
+
+        BINI_LOG(Info, Memory, "Render graph transient memory: " + std::to_string(aliasedBytes / 1024) + " KiB aliased, " +
+                               std::to_string(transientBytes / 1024) + " KiB without aliasing");
+    }
+
+    void placeInHeap(Resource index)
+    {
+        ResourceNode &resource = resources[index];
+        const Lifetime &lifetime = lifetimes[index];
+
+        // Images and buffers are kept apart, so bufferImageGranularity never matters.
+        size_t heapIndex = 0;
+        while (heapIndex < heaps.size() &&
+               (heaps[heapIndex].images != resource.isImage || heaps[heapIndex].memoryTypeBits != resource.requirements.memoryTypeBits))
+        {
+            heapIndex++;
+        }
+        if (heapIndex == heaps.size())
+        {
+            AliasHeap heap;
+            heap.images = resource.isImage;
+            heap.memoryTypeBits = resource.requirements.memoryTypeBits;
+            heaps.push_back(heap);
+        }
+        AliasHeap &heap = heaps[heapIndex];
+
+        // Ranges of the heap taken by resources alive at the same time.
+        std::vector<std::pair<VkDeviceSize, VkDeviceSize>> taken;
+        for (Resource other : heap.resources)
+        {
+            const Lifetime &otherLifetime = lifetimes[other];
+            if (otherLifetime.first <= lifetime.last && lifetime.first <= otherLifetime.last)
+            {
+                taken.push_back({resources[other].heapOffset, resources[other].heapOffset + resources[other].requirements.size});
+            }
+        }
+        std::sort(taken.begin(), taken.end());
+
+        VkDeviceSize alignment = resource.requirements.alignment;
+        VkDeviceSize offset = 0;
+        for (const auto &range : taken)
+        {
+            if (offset + resource.requirements.size <= range.first)
+            {
+                break;
+            }
+            offset = std::max(offset, (range.second + alignment - 1) / alignment * alignment);
+        }
+
+        resource.heap = static_cast<uint32_t>(heapIndex);
+        resource.heapOffset = offset;
+        heap.size = std::max(heap.size, offset + resource.requirements.size);
+        heap.alignment = std::max(heap.alignment, alignment);
+
+        // Whoever else uses this memory, before or after us, has to be
+        // waited for by the first barrier of the one that comes later.
+        for (Resource other : heap.resources)
+        {
+            const ResourceNode &otherResource = resources[other];
+            if (otherResource.heapOffset < offset + resource.requirements.size && offset < otherResource.heapOffset + otherResource.requirements.size)
+            {
+                resources[other].aliases.push_back(index);
+                resource.aliases.push_back(other);
+            }
+        }
+        heap.resources.push_back(index);
+    }
+
+    // The memory of a transient was used by someone else before its first
+    // use: an earlier resource sharing it in this frame, or the last users
+    // of it in the previous frame. Its first barrier has to wait for them.
+    void initialTransientState(Resource index, ResourceState &state)
+    {
+        const ResourceNode &resource = resources[index];
+        const Lifetime &lifetime = lifetimes[index];
+        std::vector<Resource> previous;
+        for (Resource other : resource.aliases)
+        {
+            if (lifetimes[other].last < lifetime.first)
+            {
+                previous.push_back(other);
+            }
+        }
+        if (previous.empty())
+        {
+            // First in the frame, wait for the end of the previous frame.
+            previous = resource.aliases;
+            previous.push_back(index);
+        }
+        for (Resource other : previous)
+        {
+            state.writeStages |= lifetimes[other].lastStages;
+            state.writeAccess |= lifetimes[other].lastWriteAccess;
+        }
+    }
+
+    // Add what it takes to go from state to usage, and update the state.
+    // Reads after reads in the same layout need nothing, reads that a
+    // previous barrier already made visible need nothing either.
+    void transition(Resource resource, ResourceState &state, ResourceUsage usage, BarrierBatch &batch)
+    {
+        UsageInfo info = usageInfo(usage);
+        bool isImage = resources[resource].isImage;
+        bool layoutChange = isImage && state.layout != info.layout;
+
+        if (info.write || layoutChange)
+        {
+            Barrier barrier{resource, 0, info.access, state.layout, isImage ? info.layout : VK_IMAGE_LAYOUT_UNDEFINED};
+            if (state.readStages != 0)
+            {
+                // Write after read only has to wait for the reads, the data
+                // they read was made visible by an earlier barrier.
+                batch.srcStages |= state.readStages;
+            }
+            else
+            {
+                batch.srcStages |= state.writeStages != 0 ? state.writeStages : static_cast<VkPipelineStageFlags>(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+                barrier.srcAccess = state.writeAccess;
+            }
+            batch.dstStages |= info.stage;
+            batch.barriers.push_back(barrier);
+
+            // A layout transition counts as a write done before info.stage.
+            state.layout = isImage ? info.layout : state.layout;
+            state.writeStages = info.stage;
+            state.writeAccess = info.write ? info.access : 0;
+            state.readStages = info.write ? 0 : info.stage;
+            state.readAccess = info.write ? 0 : info.access;
+            return;
+        }
+
+        bool alreadyVisible = (state.readStages & info.stage) == info.stage && (state.readAccess & info.access) == info.access;
+        if (state.writeStages == 0 || alreadyVisible)
+        {
+            // Never written in this frame, or the last barrier covered us.
+            state.readStages |= info.stage;
+            state.readAccess |= info.access;
+            return;
+        }
+        batch.srcStages |= state.writeStages;
+        batch.dstStages |= info.stage;
+        batch.barriers.push_back({resource, state.writeAccess, info.access, state.layout, state.layout});
+        state.readStages |= info.stage;
+        state.readAccess |= info.access;
+    }
+
+    void computeBarriers()
+    {
+        std::vector<ResourceState> states(resources.size());
+        for (size_t i = 0; i < resources.size(); i++)
+        {
+            states[i].layout = resources[i].initialLayout;
+            states[i].writeStages = resources[i].initialStages;
+            if (!resources[i].imported && lifetimes[i].used)
+            {
+                initialTransientState(i, states[i]);
+            }
+        }
+
+        steps.clear();
+        for (uint32_t i = 0; i < passes.size(); i++)
+        {
+            if (passes[i].culled)
+            {
+                continue;
+            }
+            Step step;
+            step.pass = i;
+            for (const auto &access : passes[i].accesses)
+            {
+                transition(access.first, states[access.first], access.second, step.before);
+            }
+            steps.push_back(std::move(step));
+        }
+
+        finalBarriers = BarrierBatch{};
+        for (uint32_t i = 0; i < resources.size(); i++)
+        {
+            if (resources[i].output)
+            {
+                transition(i, states[i], resources[i].finalUsage, finalBarriers);
+            }
+        }
+    }
+
+    void recordBarriers(VkCommandBuffer commandBuffer, const BarrierBatch &batch) const
+    {
+        if (batch.barriers.empty())
+        {
+            return;
+        }
+        std::vector<VkImageMemoryBarrier> imageBarriers;
+        std::vector<VkBufferMemoryBarrier> bufferBarriers;
+        for (const auto &barrier : batch.barriers)
+        {
+            const ResourceNode &resource = resources[barrier.resource];
+            if (resource.isImage)
+            {
+                VkImageMemoryBarrier imageBarrier{};
+                imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+                imageBarrier.srcAccessMask = barrier.srcAccess;
+                imageBarrier.dstAccessMask = barrier.dstAccess;
+                imageBarrier.oldLayout = barrier.oldLayout;
+                imageBarrier.newLayout = barrier.newLayout;
+                imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                imageBarrier.image = resource.image;
+                imageBarrier.subresourceRange = {resource.aspect, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS};
+                imageBarriers.push_back(imageBarrier);
+            }
+            else
+            {
+                VkBufferMemoryBarrier bufferBarrier{};
+                bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+                bufferBarrier.srcAccessMask = barrier.srcAccess;
+                bufferBarrier.dstAccessMask = barrier.dstAccess;
+                bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                bufferBarrier.buffer = resource.buffer;
+                bufferBarrier.offset = 0;
+                bufferBarrier.size = VK_WHOLE_SIZE;
+                bufferBarriers.push_back(bufferBarrier);
+            }
+        }
+        vkCmdPipelineBarrier(commandBuffer, batch.srcStages, batch.dstStages, 0, 0, nullptr,
+                             static_cast<uint32_t>(bufferBarriers.size()), bufferBarriers.data(),
+                             static_cast<uint32_t>(imageBarriers.size()), imageBarriers.data());
+    }
+};
+
+// 107 - Render passes and framebuffers for devices without dynamic rendering.
+// Each is created the first time its attachment signature shows up and then
+// found through a hash lookup: render passes by formats, load/store ops and
+// layouts, framebuffers by render pass, image views and size. Views die with
+// their swap chain, evictView() then destroys every framebuffer using them.
+class RenderPassCache
+{
+public:
+    static constexpr uint32_t MAX_ATTACHMENTS = 8;
+
+    // How the render pass uses one attachment. The layout is the same before,
+    // during and after the pass, transitions are the render graph's job. A
+    // depth/stencil layout makes it the depth attachment, the rest are color
+    // attachments in order.
+    struct Attachment
+    {
+        VkFormat format = VK_FORMAT_UNDEFINED;
+        VkAttachmentLoadOp loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        VkAttachmentStoreOp storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+        VkImageLayout layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    };
+
+    struct RenderPassKey
+    {
+        uint32_t attachmentCount = 0;
+        Attachment attachments[MAX_ATTACHMENTS];
+
+        bool operator==(const RenderPassKey &other) const
+        {
+            if (attachmentCount != other.attachmentCount)
+            {
+                return false;
+            }
+            for (uint32_t i = 0; i < attachmentCount; i++)
+            {
+                const Attachment &a = attachments[i];
+                const Attachment &b = other.attachments[i];
+                if (a.format != b.format || a.loadOp != b.loadOp || a.storeOp != b.storeOp || a.layout != b.layout)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    struct FramebufferKey
+    {
+        VkRenderPass renderPass = VK_NULL_HANDLE;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t attachmentCount = 0;
+        VkImageView views[MAX_ATTACHMENTS] = {};
+
+        bool operator==(const FramebufferKey &other) const
+        {
+            return renderPass == other.renderPass && width == other.width && height == other.height &&
+                   attachmentCount == other.attachmentCount && std::equal(views, views + attachmentCount, other.views);
+        }
+    };
+
+    void init(VkDevice logicalDevice)
+    {
+        device = logicalDevice;
+    }
+
+    void cleanup()
+    {
+        for (const auto &[key, framebuffer] : framebuffers)
+        {
+            vkDestroyFramebuffer(device, framebuffer, nullptr);
+        }
+        for (const auto &[key, renderPass] : renderPasses)
+        {
+            vkDestroyRenderPass(device, renderPass, nullptr);
+        }
+        if (hits + misses > 0)
+        {
+            BINI_LOG(Info, Render, "Render pass cache: " + std::to_string(hits) + " hits, " + std::to_string(misses) + " misses, " +
+                                   std::to_string(renderPasses.size()) + " render passes, " + std::to_string(createdFramebuffers) +
+                                   " framebuffers created, " + std::to_string(evictedFramebuffers) + " evicted");
+        }
+        framebuffers.clear();
+        renderPasses.clear();
+        viewUsers.clear();
+    }
+
+    VkRenderPass renderPass(const RenderPassKey &key)
+    {
+        auto it = renderPasses.find(key);
+        if (it != renderPasses.end())
+        {
+            hits++;
+            return it->second;
+        }
+        misses++;
+
+        VkAttachmentDescription descriptions[MAX_ATTACHMENTS]{};
+        VkAttachmentReference colorReferences[MAX_ATTACHMENTS]{};
+        VkAttachmentReference depthReference{};
+        uint32_t colorCount = 0;
+        bool hasDepth = false;
+        for (uint32_t i = 0; i < key.attachmentCount; i++)
+        {
+            const Attachment &attachment = key.attachments[i];
+            VkAttachmentDescription &description = descriptions[i];
+            description.format = attachment.format;
+            description.samples = VK_SAMPLE_COUNT_1_BIT;
+            description.loadOp = attachment.loadOp;
+            description.storeOp = attachment.storeOp;
+            description.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+            description.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            description.initialLayout = attachment.layout;
+            description.finalLayout = attachment.layout;
+            if (attachment.layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+            {
+                depthReference = {i, attachment.layout};
+                hasDepth = true;
+            }
+            else
+            {
+                colorReferences[colorCount++] = {i, attachment.layout};
+            }
+        }
+
+        VkSubpassDescription subpass{};
+        subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpass.colorAttachmentCount = colorCount;
+        subpass.pColorAttachments = colorReferences;
+        subpass.pDepthStencilAttachment = hasDepth ? &depthReference : nullptr;
+
+        VkRenderPassCreateInfo createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+        createInfo.attachmentCount = key.attachmentCount;
+        createInfo.pAttachments = descriptions;
+        createInfo.subpassCount = 1;
+        createInfo.pSubpasses = &subpass;
+
+        VkRenderPass renderPass;
+        if (vkCreateRenderPass(device, &createInfo, nullptr, &renderPass) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create render pass!");
+        }
+        renderPasses.emplace(key, renderPass);
+        return renderPass;
+    }
+
+    VkFramebuffer framebuffer(const FramebufferKey &key)
+    {
+        auto it = framebuffers.find(key);
+        if (it != framebuffers.end())
+        {
+            hits++;
+            return it->second;
+        }
+        misses++;
+
+        VkFramebufferCreateInfo createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        createInfo.renderPass = key.renderPass;
+        createInfo.attachmentCount = key.attachmentCount;
+        createInfo.pAttachments = key.views;
+        createInfo.width = key.width;
+        createInfo.height = key.height;
+        createInfo.layers = 1;
+
+        VkFramebuffer framebuffer;
+        if (vkCreateFramebuffer(device, &createInfo, nullptr, &framebuffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create framebuffer!");
+        }
+        framebuffers.emplace(key, framebuffer);
+        for (uint32_t i = 0; i < key.attachmentCount; i++)
+        {
+            viewUsers[key.views[i]].push_back(key);
+        }
+        createdFramebuffers++;
+        return framebuffer;
+    }
+
+    // The view is about to be destroyed, so is every framebuffer built with it.
+    // The caller makes sure the GPU is done with them.
+    void evictView(VkImageView view)
+    {
+        auto users = viewUsers.find(view);
+        if (users == viewUsers.end())
+        {
+            return;
+        }
+        std::vector<FramebufferKey> keys = std::move(users->second);
+        viewUsers.erase(users);
+        for (const FramebufferKey &key : keys)
+        {
+            auto it = framebuffers.find(key);
+            if (it == framebuffers.end())
+            {
+                // Already gone through another of its views.
+                continue;
+            }
+            vkDestroyFramebuffer(device, it->second, nullptr);
+            framebuffers.erase(it);
+            evictedFramebuffers++;
+            // The other views of the framebuffer don't need to remember it anymore.
+            for (uint32_t i = 0; i < key.attachmentCount; i++)
+            {
+                auto other = viewUsers.find(key.views[i]);
+                if (other != viewUsers.end())
+                {
+                    auto &list = other->second;
+                    list.erase(std::remove(list.begin(), list.end(), key), list.end());
+                    if (list.empty())
+                    {
+                        viewUsers.erase(other);
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    // FNV-1a over the fields that make up a key.
+    struct KeyHash
+    {
+        static void mix(uint64_t &hash, uint64_t value)
+        {
+            for (int byte = 0; byte < 8; byte++)
+            {
+                hash ^= (value >> (byte * 8)) & 0xff;
+                hash *= 1099511628211ull;
+            }
+        }
+
+        size_t operator()(const RenderPassKey &key) const
+        {
+            uint64_t hash = 14695981039346656037ull;
+            mix(hash, key.attachmentCount);
+            for (uint32_t i = 0; i < key.attachmentCount; i++)
+            {
+                const Attachment &attachment = key.attachments[i];
+                mix(hash, (static_cast<uint64_t>(attachment.format) << 32) | (static_cast<uint64_t>(attachment.layout) << 8) |
+                              (static_cast<uint64_t>(attachment.loadOp) << 4) | static_cast<uint64_t>(attachment.storeOp));
+            }
+            return static_cast<size_t>(hash);
+        }
+
+        size_t operator()(const FramebufferKey &key) const
+        {
+            uint64_t hash = 14695981039346656037ull;
+            mix(hash, std::hash<VkRenderPass>{}(key.renderPass));
+            mix(hash, (static_cast<uint64_t>(key.width) << 32) | key.height);
+            for (uint32_t i = 0; i < key.attachmentCount; i++)
+            {
+                mix(hash, std::hash<VkImageView>{}(key.views[i]));
+            }
+            return static_cast<size_t>(hash);
+        }
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    std::unordered_map<RenderPassKey, VkRenderPass, KeyHash> renderPasses;
+    std::unordered_map<FramebufferKey, VkFramebuffer, KeyHash> framebuffers;
+    // Which framebuffers use each view, so eviction never scans the whole cache.
+    std::unordered_map<VkImageView, std::vector<FramebufferKey>> viewUsers;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t createdFramebuffers = 0;
+    uint64_t evictedFramebuffers = 0;
+};
+
+// 104 - Starts and ends rendering into a color target that the render graph
+// already put in COLOR_ATTACHMENT_OPTIMAL. With dynamic rendering (1.3 or
+// VK_KHR_dynamic_rendering) there are no VkRenderPass or VkFramebuffer objects:
+// pipelines are built against formats only and a swap chain resize changes
+// nothing. Without it render passes and framebuffers come from the
+// RenderPassCache, render passes outlive resizes so pipelines made against
+// them stay compatible.
+class RenderingPath
+{
+public:
+    struct Target
+    {
+        VkImageView view = VK_NULL_HANDLE;
+        VkFormat format = VK_FORMAT_UNDEFINED;
+        VkExtent2D extent{};
+    };
+
+    // What secondaries recorded inside begin() inherit, filled by fillInheritance().
+    struct Inheritance
+    {
+        VkFormat format = VK_FORMAT_UNDEFINED;
+        VkCommandBufferInheritanceRenderingInfo rendering{};
+        VkCommandBufferInheritanceInfo info{};
+    };
+
+    void init(VkDevice logicalDevice, bool useDynamicRendering, uint32_t apiVersion)
+    {
+        dynamicRendering = useDynamicRendering;
+        cache.init(logicalDevice);
+        if (dynamicRendering)
+        {
+            // Core names since 1.3, the extension ones before.
+            bool core = apiVersion >= VK_API_VERSION_1_3;
+            beginRendering = reinterpret_cast<PFN_vkCmdBeginRenderingKHR>(
+                vkGetDeviceProcAddr(logicalDevice, core ? "vkCmdBeginRendering" : "vkCmdBeginRenderingKHR"));
+            endRendering = reinterpret_cast<PFN_vkCmdEndRenderingKHR>(
+                vkGetDeviceProcAddr(logicalDevice, core ? "vkCmdEndRendering" : "vkCmdEndRenderingKHR"));
+            if (beginRendering == nullptr || endRendering == nullptr)
+            {
+                throw std::runtime_error("Dynamic rendering enabled but its functions are missing!");
+            }
+        }
+        BINI_LOG(Info, Render, dynamicRendering ? "Rendering with dynamic rendering" : "Rendering with cached render passes");
+    }
+
+    void cleanup()
+    {
+        cache.cleanup();
+    }
+
+    bool usesDynamicRendering() const
+    {
+        return dynamicRendering;
+    }
+
+    // Creates what drawing into the target needs ahead of time, so the first
+    // frame after a swap chain (re)creation finds it in the cache.
+    void prepare(const Target &target)
+    {
+        if (!dynamicRendering)
+        {
+            framebuffer(target);
+        }
+    }
+
+    // Clears the target and starts rendering into it. With secondaries the
+    // draws come from vkCmdExecuteCommands, recorded with fillInheritance().
+    void begin(VkCommandBuffer commandBuffer, const Target &target, const VkClearColorValue &clearColor, bool secondaries)
+    {
+        VkClearValue clearValue{};
+        clearValue.color = clearColor;
+        VkRect2D renderArea{{0, 0}, target.extent};
+
+        if (dynamicRendering)
+        {
+            VkRenderingAttachmentInfo colorAttachment{};
+            colorAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+            colorAttachment.imageView = target.view;
+            colorAttachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+            colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+            colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+            colorAttachment.clearValue = clearValue;
+
+            VkRenderingInfo renderingInfo{};
+            renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+            renderingInfo.flags = secondaries ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT : 0;
+            renderingInfo.renderArea = renderArea;
+            renderingInfo.layerCount = 1;
+            renderingInfo.colorAttachmentCount = 1;
+            renderingInfo.pColorAttachments = &colorAttachment;
+            beginRendering(commandBuffer, &renderingInfo);
+            return;
+        }
+
+        VkRenderPassBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        beginInfo.renderPass = renderPass(target.format);
+        beginInfo.framebuffer = framebuffer(target);
+        beginInfo.renderArea = renderArea;
+        beginInfo.clearValueCount = 1;
+        beginInfo.pClearValues = &clearValue;
+        vkCmdBeginRenderPass(commandBuffer, &beginInfo, secondaries ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
+    }
+
+    void end(VkCommandBuffer commandBuffer)
+    {
+        if (dynamicRendering)
+        {
+            endRendering(commandBuffer);
+        }
+        else
+        {
+            vkCmdEndRenderPass(commandBuffer);
+        }
+    }
+
+    // Links everything inside the caller's struct, it has to outlive the recording.
+    void fillInheritance(const Target &target, Inheritance &inheritance)
+    {
+        inheritance.info = {};
+        inheritance.info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        if (dynamicRendering)
+        {
+            inheritance.format = target.format;
+            inheritance.rendering = {};
+            inheritance.rendering.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO;
+            inheritance.rendering.flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT;
+            inheritance.rendering.colorAttachmentCount = 1;
+            inheritance.rendering.pColorAttachmentFormats = &inheritance.format;
+            inheritance.rendering.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+            inheritance.info.pNext = &inheritance.rendering;
+            return;
+        }
+        inheritance.info.renderPass = renderPass(target.format);
+        inheritance.info.subpass = 0;
+        inheritance.info.framebuffer = framebuffer(target);
+    }
+
+    // What a pipeline drawing into this format is built against. VK_NULL_HANDLE
+    // with dynamic rendering, chain a VkPipelineRenderingCreateInfo instead.
+    VkRenderPass pipelineRenderPass(VkFormat format)
+    {
+        return dynamicRendering ? VK_NULL_HANDLE : renderPass(format);
+    }
+
+    // The view is about to be destroyed (old swap chain), drop what was made for it.
+    void forgetView(VkImageView view)
+    {
+        cache.evictView(view);
+    }
+
+private:
+    bool dynamicRendering = false;
+    PFN_vkCmdBeginRenderingKHR beginRendering = nullptr;
+    PFN_vkCmdEndRenderingKHR endRendering = nullptr;
+    RenderPassCache cache;
+
+    // The scene pass clears and stores its single color attachment.
+    VkRenderPass renderPass(VkFormat format)
+    {
+        RenderPassCache::RenderPassKey key;
+        key.attachmentCount = 1;
+        key.attachments[0] = {format, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+        return cache.renderPass(key);
+    }
+
+    VkFramebuffer framebuffer(const Target &target)
+    {
+        RenderPassCache::FramebufferKey key;
+        key.renderPass = renderPass(target.format);
+        key.width = target.extent.width;
+        key.height = target.extent.height;
+        key.attachmentCount = 1;
+        key.views[0] = target.view;
+        return cache.framebuffer(key);
+    }
+};
+
+// 92 - Receives what the validation layers have to say and sends it to the
+// log. Messages under the configured severity or with a muted message ID are
+// dropped, and every message ID is only logged a few times so one mistake
+// made every frame doesn't bury everything else.
+class ValidationMessenger
+{
+public:
+    static constexpr uint32_t MAX_REPEATS = 5;
+
+    // ignoredIds are message ID names (VUID-...) or numbers (hex or decimal).
+    void configure(VkDebugUtilsMessageSeverityFlagBitsEXT severity, const std::vector<std::string> &ignoredIds)
+    {
+        minSeverity = severity;
+        ignoredNames.clear();
+        ignoredNumbers.clear();
+        for (const auto &id : ignoredIds)
+        {
+            if (!id.empty() && std::isdigit(static_cast<unsigned char>(id[0])))
+            {
+                ignoredNumbers.insert(static_cast<int32_t>(std::stoul(id, nullptr, 0)));
+            }
+            else
+            {
+                ignoredNames.insert(id);
+            }
+        }
+    }
+
+    // Chained into VkInstanceCreateInfo as well, the messenger object can't
+    // exist before the instance nor after it.
+    VkDebugUtilsMessengerCreateInfoEXT createInfo()
+    {
+        VkDebugUtilsMessengerCreateInfoEXT info{};
+        info.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
+        // Everything from the minimum severity up.
+        info.messageSeverity = 0;
+        for (VkDebugUtilsMessageSeverityFlagBitsEXT severity : {VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT, VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT,
+                                                                VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT, VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT})
+        {
+            if (severity >= minSeverity)
+            {
+                info.messageSeverity |= severity;
+            }
+        }
+        info.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
+                           VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+        info.pfnUserCallback = callback;
+        info.pUserData = this;
+        return info;
+    }
+
+    void create(VkInstance instance)
+    {
+        auto createMessenger = reinterpret_cast<PFN_vkCreateDebugUtilsMessengerEXT>(vkGetInstanceProcAddr(instance, "vkCreateDebugUtilsMessengerEXT"));
+        VkDebugUtilsMessengerCreateInfoEXT info = createInfo();
+        if (createMessenger == nullptr || createMessenger(instance, &info, nullptr, &messenger) != VK_SUCCESS)
+        {
+            BINI_LOG(Warning, Validation, "Couldn't create the debug messenger, validation messages are lost.");
+        }
+    }
+
+    void destroy(VkInstance instance)
+    {
+        if (messenger != VK_NULL_HANDLE)
+        {
+            auto destroyMessenger = reinterpret_cast<PFN_vkDestroyDebugUtilsMessengerEXT>(vkGetInstanceProcAddr(instance, "vkDestroyDebugUtilsMessengerEXT"));
+            destroyMessenger(instance, messenger, nullptr);
+            messenger = VK_NULL_HANDLE;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &entry : counts)
+        {
+            if (entry.second > MAX_REPEATS)
+            {
+                BINI_LOG(Warning, Validation, entry.first + " was reported " + std::to_string(entry.second) + " times, only the first " +
+                                                  std::to_string(MAX_REPEATS) + " were logged");
+            }
+        }
+    }
+
+private:
+    VkDebugUtilsMessengerEXT messenger = VK_NULL_HANDLE;
+    VkDebugUtilsMessageSeverityFlagBitsEXT minSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT;
+    std::set<std::string> ignoredNames;
+    std::set<int32_t> ignoredNumbers;
+
+    // Called from whatever thread made the Vulkan call.
+    std::mutex mutex;
+    std::map<std::string, uint32_t> counts;
+
+    static VKAPI_ATTR VkBool32 VKAPI_CALL callback(VkDebugUtilsMessageSeverityFlagBitsEXT severity, VkDebugUtilsMessageTypeFlagsEXT type,
+                                                   const VkDebugUtilsMessengerCallbackDataEXT *data, void *userData)
+    {
+        auto self = static_cast<ValidationMessenger *>(userData);
+        std::string id = data->pMessageIdName != nullptr ? data->pMessageIdName : std::to_string(data->messageIdNumber);
+        if (severity < self->minSeverity || self->ignoredNumbers.count(data->messageIdNumber) > 0 || self->ignoredNames.count(id) > 0)
+        {
+            return VK_FALSE;
+        }
+        {
+            std::lock_guard<std::mutex> lock(self->mutex);
+            if (++self->counts[id] > MAX_REPEATS)
+            {
+                return VK_FALSE;
+            }
+        }
+
+        const char *prefix = type & VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT ? "[performance] " : "";
+        if (severity >= VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT)
+        {
+            BINI_LOGF(Error, Validation, "%s%s", prefix, data->pMessage);
+        }
+        else if (severity >= VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT)
+        {
+            BINI_LOGF(Warning, Validation, "%s%s", prefix, data->pMessage);
+        }
+        else if (severity >= VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT)
+        {
+            BINI_LOGF(Info, Validation, "%s%s", prefix, data->pMessage);
+        }
+        else
+        {
+            BINI_LOGF(Debug, Validation, "%s%s", prefix, data->pMessage);
+        }
+        // Never abort the call that triggered the message.
+        return VK_FALSE;
+    }
+};
+
+// 66 - Watches how long vkAcquireNextImageKHR blocks and suggests a different
+// swap chain depth. More images hide stalls but add latency, so the depth goes
+// down again when there are no stalls. A change that didn't help is undone and
+// the tuner stops, in FIFO the stall is the display rate and no depth fixes it.
+struct ImageCountTuner
+{
+    // Frames per measurement.
+    static constexpr uint32_t WINDOW = 120;
+    // Average stall per frame above which we want more images.
+    static constexpr double STALL_HIGH_MS = 1.0;
+    // Average stall below which one image less should be fine.
+    static constexpr double STALL_LOW_MS = 0.05;
+
+    double accumulatedMs = 0.0;
+    uint32_t frames = 0;
+    double previousAverageMs = 0.0;
+    int lastChange = 0;
+    bool settled = false;
+
+    // Returns the change to apply to the image count: +1, -1 or 0.
+    int addSample(double stallMs)
+    {
+        accumulatedMs += stallMs;
+        frames++;
+        if (settled || frames < WINDOW)
+        {
+            return 0;
+        }
+        double average = accumulatedMs / frames;
+        accumulatedMs = 0.0;
+        frames = 0;
+
+        int change = 0;
+        if (lastChange > 0 && average > previousAverageMs * 0.75)
+        {
+            // More images didn't remove the stall, go back.
+            change = -1;
+            settled = true;
+        }
+        else if (lastChange < 0 && average > STALL_HIGH_MS)
+        {
+            // One less was too few.
+            change = 1;
+            settled = true;
+        }
+        else if (average > STALL_HIGH_MS)
+        {
+            change = 1;
+        }
+        else if (average < STALL_LOW_MS)
+        {
+            change = -1;
+        }
+        previousAverageMs = average;
+        lastChange = change;
+        return change;
+    }
+};
+
+// 49 - Result of rating a physical device, with the reasons behind the score so
+// we can tell why a device won or lost. Unsuitable devices are never picked.
+struct DeviceRating
+{
+    VkPhysicalDevice device = VK_NULL_HANDLE;
+    std::string name;
+    std::string uuid;
+    bool suitable = false;
+    uint64_t score = 0;
+    std::vector<std::string> reasons;
+};
+
+// 95 - What the logical device was actually created with. The API version is
+// the one both the instance and the device agree on, the flags are only set
+// when the feature was supported and enabled, so code can branch on them.
+struct DeviceCapabilities
+{
+    uint32_t apiVersion = VK_API_VERSION_1_0;
+    bool timelineSemaphore = false;
+    bool synchronization2 = false;
+    bool dynamicRendering = false;
+    bool descriptorIndexing = false;
+    bool bufferDeviceAddress = false;
+    // What each extension brings is available, as an enabled extension or
+    // because it's core in apiVersion.
+    DeviceExtensionSet extensions;
+
+    std::string describe() const
+    {
+        std::string text = "Vulkan " + std::to_string(VK_API_VERSION_MAJOR(apiVersion)) + "." +
+                           std::to_string(VK_API_VERSION_MINOR(apiVersion)) + "." + std::to_string(VK_API_VERSION_PATCH(apiVersion));
+        auto add = [&text](bool enabled, const char *name)
+        {
+            text += std::string(", ") + name + (enabled ? " on" : " off");
+        };
+        add(timelineSemaphore, "timeline semaphores");
+        add(synchronization2, "synchronization2");
+        add(dynamicRendering, "dynamic rendering");
+        add(descriptorIndexing, "descriptor indexing");
+        add(bufferDeviceAddress, "buffer device address");
+        for (const char *name : extensions.names())
+        {
+            text += std::string(", ") + name;
+        }
+        return text;
+    }
+};
+
+// 100 - Every feature struct we query or enable. link() chains the ones the
+// device knows: the per version structs by API version and the extension
+// structs only for extensions enabled as such, never both for one feature.
+// The chain points into itself, so it can't be copied.
+struct DeviceFeatureChain
+{
+    VkPhysicalDeviceFeatures2 features2{};
+    VkPhysicalDeviceVulkan11Features vulkan11{};
+    VkPhysicalDeviceVulkan12Features vulkan12{};
+    VkPhysicalDeviceVulkan13Features vulkan13{};
+    VkPhysicalDeviceTimelineSemaphoreFeatures timelineSemaphore{};
+    VkPhysicalDeviceSynchronization2Features synchronization2{};
+    VkPhysicalDeviceDynamicRenderingFeatures dynamicRendering{};
+    VkPhysicalDevicePipelineCreationCacheControlFeatures pipelineCreationCacheControl{};
+    VkPhysicalDeviceMaintenance4Features maintenance4{};
+    VkPhysicalDevicePresentIdFeaturesKHR presentId{};
+    VkPhysicalDevicePresentWaitFeaturesKHR presentWait{};
+
+    DeviceFeatureChain()
+    {
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        vulkan11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+        vulkan12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        vulkan13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+        timelineSemaphore.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+        synchronization2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES;
+        dynamicRendering.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES;
+        pipelineCreationCacheControl.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PIPELINE_CREATION_CACHE_CONTROL_FEATURES;
+        maintenance4.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MAINTENANCE_4_FEATURES;
+        presentId.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+        presentWait.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    }
+    DeviceFeatureChain(const DeviceFeatureChain &) = delete;
+    DeviceFeatureChain &operator=(const DeviceFeatureChain &) = delete;
+
+    void link(uint32_t apiVersion, const DeviceExtensionSet &extensions)
+    {
+        void **next = &features2.pNext;
+        auto append = [&next](auto &feature)
+        {
+            *next = &feature;
+            next = &feature.pNext;
+        };
+        // The per version structs are only known by 1.2 and newer.
+        if (apiVersion >= VK_API_VERSION_1_2)
+        {
+            append(vulkan11);
+            append(vulkan12);
+        }
+        if (apiVersion >= VK_API_VERSION_1_3)
+        {
+            append(vulkan13);
+        }
+        if (extensions.has(DeviceExtension::TimelineSemaphore))
+        {
+            append(timelineSemaphore);
+        }
+        if (extensions.has(DeviceExtension::Synchronization2))
+        {
+            append(synchronization2);
+        }
+        if (extensions.has(DeviceExtension::DynamicRendering))
+        {
+            append(dynamicRendering);
+        }
+        if (extensions.has(DeviceExtension::PipelineCreationCacheControl))
+        {
+            append(pipelineCreationCacheControl);
+        }
+        if (extensions.has(DeviceExtension::Maintenance4))
+        {
+            append(maintenance4);
+        }
+        if (extensions.has(DeviceExtension::PresentId))
+        {
+            append(presentId);
+        }
+        if (extensions.has(DeviceExtension::PresentWait))
+        {
+            append(presentWait);
+        }
+        *next = nullptr;
+    }
+};
+
+// 41 - Everything a single frame in flight owns. While the GPU is working on
+// one slot the CPU is free to record the next one without waiting.
+struct FrameSlot
+{
+    // A pool per frame lets us reset everything the frame recorded in one call.
+    VkCommandPool commandPool = VK_NULL_HANDLE;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+
+    // Signaled when the swap chain hands us an image to draw into.
+    VkSemaphore imageAvailable = VK_NULL_HANDLE;
+
+    // Reached on the graphics lane once the commands of this slot finished.
+    GpuTimeline::Point lastSubmit;
+
+    // Only without timeline semaphores: the staging flush signals it and the
+    // frame's submit waits on it, so uploads stay ordered on the GPU.
+    VkSemaphore uploadsDone = VK_NULL_HANDLE;
+};
+
+// how to define a class in C++
+// can be done in a single file
+// can be separated in header + definition
+class FirstVulkanExample
+{
+    // in a c++ class we classify first by access modifier
+public:
+    explicit FirstVulkanExample(const AppConfig &config) : config(config) {}
+
+    void run()
+    {
+        if (!config.cpuTracePath.empty())
+        {
+            CpuProfiler::instance().enable();
+        }
+
+        // fun stuff here later!
+        if (!config.headless)
+        {
+            initWindow();
+        }
+        initVulkan();
+        if (config.benchUploadMegabytes > 0)
+        {
+            benchmarkUploads();
+        }
+        if (config.benchRecord)
+        {
+            benchmarkRecording();
+        }
+        mainLoop();
+        cleanup();
+
+        // Worker threads are gone, nobody is recording zones anymore.
+        if (!config.cpuTracePath.empty())
+        {
+            CpuProfiler::instance().writeChromeTrace(config.cpuTracePath);
+        }
+    }
+
+private:
+    AppConfig config;
+
+    // We can declare attributes here.
+    // The first thing is the window object.
+    GLFWwindow *window = nullptr;
+
+    // Need to create a Vulkan instance.
+    VkInstance instance;
+
+    // 93 - Where validation messages end up when validation is on.
+    ValidationMessenger validationMessenger;
+
+    // 1.2 - We need an instance that saves the reference of the physical device
+    // used by Vulkan.
+    // Important: This reference is cleanup when destroying Vulkan instance.
+    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+
+    // 96 - Highest version the loader and us both know, and what the device
+    // ended up with. Anything past 1.0 is only used when these allow it.
+    uint32_t instanceApiVersion = VK_API_VERSION_1_0;
+    DeviceCapabilities deviceCapabilities;
+
+    // 1.8 - Add logical device - It can be n by physical device.
+    VkDevice device;
+
+    // 72 - Every buffer and image gets its memory from here.
+    DeviceMemoryAllocator memoryAllocator;
+
+    // 103 - Every submit signals a point here, every wait for the GPU goes through it.
+    GpuTimeline gpuTimeline;
+
+    // 110 - What was replaced at runtime, destroyed once the GPU is past it.
+    DeletionQueue deletionQueue;
+
+    // 106 - Dynamic rendering, or render passes and framebuffers without it.
+    RenderingPath renderingPath;
+    // Where the scene pass of the frame being recorded draws.
+    RenderingPath::Target sceneTarget;
+
+    // 76 - Uploads to device local memory go through here.
+    StagingRing stagingRing;
+
+    // 79 - Workers for --record-threads and the layout the draws push their
+    // constants with.
+    ParallelRecorder recorder;
+    VkPipelineLayout scenePipelineLayout = VK_NULL_HANDLE;
+
+    // 83 - Passes of a frame. Built once, only the swap chain image it
+    // renders to changes every frame.
+    RenderGraph renderGraph;
+    RenderGraph::Resource backbuffer = 0;
+
+    // 88 - GPU timings of the passes, when --gpu-profile is on.
+    GpuProfiler gpuProfiler;
+
+    // Where the submit waits for the acquired image. The graph's first
+    // barrier on the backbuffer has to start from these stages.
+    static constexpr VkPipelineStageFlags ACQUIRE_WAIT_STAGES = VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+
+    // 73 - Compiled pipelines survive between runs through this cache.
+    VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+    bool pipelineCacheWarm = false;
+    // What we loaded, so we don't write the same bytes back.
+    std::vector<char> loadedPipelineCache;
+
+    // When logical device is created a graphics queue is created.
+    VkQueue graphicsQueue;
+
+    // 13 - Create the surface
+    // Surface - Space where the render will be presented.
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
+
+    // 17 - Add a reference to work with the presentation queue.
+    VkQueue presentQueue;
+
+    // 53 - Async compute and transfer queues. When the device has no dedicated
+    // family for them they are the graphics queue.
+    VkQueue computeQueue;
+    VkQueue transferQueue;
+
+    // Families of the device we picked, so we don't have to search them again.
+    QueueFamilyIndexes queueFamilyIndexes;
+
+    // 56 - Every queue we created, by family, highest priority first.
+    // The queues above are the first (highest priority) queue of their family.
+    std::map<uint32_t, std::vector<PriorityQueue>> familyQueues;
+
+    // 33 - Create an instance to save our newly created swap chain.
+    VkSwapchainKHR swapChain = VK_NULL_HANDLE;
+
+    // 35 - Declare the images that will be used by the swap chain.
+    // In headless mode these are our own offscreen images instead.
+    std::vector<VkImage> swapChainImages;
+
+    // 105 - A view per swap chain image, what rendering draws into.
+    std::vector<VkImageView> swapChainImageViews;
+
+    // 108 - The same images seen through the sRGB/UNORM counterpart of their
+    // format, so a pass can write linear values into an sRGB swap chain (or
+    // the other way around) without a copy. VK_FORMAT_UNDEFINED and no views
+    // when the images can't be created with a mutable format.
+    VkFormat swapChainAlternateFormat = VK_FORMAT_UNDEFINED;
+    std::vector<VkImageView> swapChainAlternateViews;
+
+    // 47 - Memory behind the offscreen images when running headless.
+    std::vector<MemoryAllocation> offscreenImageMemory;
+    uint32_t nextOffscreenImage = 0;
+
+    // 37 - Save the reference to the format and extent that we got as result
+    VkFormat swapChainImageFormat;
+    VkExtent2D swapChainExtent;
+    VkPresentModeKHR swapChainPresentMode = VK_PRESENT_MODE_FIFO_KHR;
+    // Only asked for by the transient demo, it blits into the images.
+    bool swapChainTransferDst = false;
+
+    // 42 - One slot per frame in flight, used round robin.
+    std::vector<FrameSlot> frames;
+    uint32_t currentFrame = 0;
+
+    // The present has to wait for the rendering of the image it shows. This
+    // semaphore belongs to the swap chain image and not the frame slot, the
+    // presentation engine can hold it longer than a frame slot lives.
+    std::vector<VkSemaphore> renderFinishedSemaphores;
+
+    // Submit that last rendered into each swap chain image.
+    std::vector<GpuTimeline::Point> imagesInFlight;
+
+    // Frame counters used to report frames per second.
+    uint64_t frameCount = 0;
+
+    // 61 - Resize handling, set from the GLFW callback.
+    bool framebufferResized = false;
+    std::chrono::steady_clock::time_point lastResizeEvent;
+
+    // Set when the present policy changed and the swap chain has to follow.
+    bool presentPolicyChanged = false;
+
+    // 67 - Images we ask for when (re)creating the swap chain and the limits
+    // of the surface, used by the auto tuning.
+    uint32_t desiredImageCount = 0;
+    uint32_t minSwapChainImages = 0;
+    uint32_t maxSwapChainImages = 0;
+    ImageCountTuner imageCountTuner;
+    bool imageCountChanged = false;
+
+    void initWindow()
+    {
+        CPU_ZONE("initWindow");
+        glfwInit();
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+        glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
+
+        window = glfwCreateWindow(WIDTH, HEIGHT, "Test Window", nullptr, nullptr);
+
+        // GLFW callbacks are plain functions, the user pointer brings us back to the app.
+        glfwSetWindowUserPointer(window, this);
+        glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+        glfwSetKeyCallback(window, keyCallback);
+    }
+
+    // P cycles through the present policies while running.
+    static void keyCallback(GLFWwindow *window, int key, int /*scancode*/, int action, int /*mods*/)
+    {
+        auto app = reinterpret_cast<FirstVulkanExample *>(glfwGetWindowUserPointer(window));
+        if (key == GLFW_KEY_P && action == GLFW_PRESS)
+        {
+            int next = (static_cast<int>(app->config.presentPolicy) + 1) % 4;
+            app->setPresentPolicy(static_cast<PresentPolicy>(next));
+        }
+    }
+
+    // 64 - Switch the present policy at runtime. The present mode is fixed per
+    // swap chain, so the swap chain is recreated after the next present.
+    void setPresentPolicy(PresentPolicy policy)
+    {
+        if (policy == config.presentPolicy)
+        {
+            return;
+        }
+        config.presentPolicy = policy;
+        presentPolicyChanged = true;
+    }
+
+    static void framebufferResizeCallback(GLFWwindow *window, int /*width*/, int /*height*/)
+    {
+        auto app = reinterpret_cast<FirstVulkanExample *>(glfwGetWindowUserPointer(window));
+        app->framebufferResized = true;
+        app->lastResizeEvent = std::chrono::steady_clock::now();
+    }
+
+    void initVulkan()
+    {
+        CPU_ZONE("initVulkan");
+        auto startupBegin = std::chrono::steady_clock::now();
+
+        // First we need to check validation layers. Without them we still
+        // run, a release machine might just not have the SDK installed.
+        if (config.validation && !checkValidationLayerSupport())
+        {
+            BINI_LOG(Warning, Validation, "Validation layers requested but not available on this system, running without them.");
+            config.validation = false;
+        }
+        // Process of vulkan setup
+        createVulkanInstance();
+        if (config.validation)
+        {
+            validationMessenger.create(instance);
+        }
+
+        // 14 - Create the surface
+        if (!config.headless)
+        {
+            createSurface();
+        }
+
+        // 1 - Once the instance is created we need to select a physical device to interact with
+        pickPhysicalDevice();
+        biniutils::logstdout("Physical device being used.");
+
+        // 9 - Once physical device is validated create logical devices.
+        createLogicalDevice();
+        memoryAllocator.init(physicalDevice, device, deviceCapabilities.apiVersion);
+        gpuTimeline.init(device, deviceCapabilities.timelineSemaphore, deviceCapabilities.apiVersion);
+        deletionQueue.init(gpuTimeline);
+        renderingPath.init(device, deviceCapabilities.dynamicRendering, deviceCapabilities.apiVersion);
+
+        // Before any pipeline gets created.
+        createPipelineCache();
+        createStagingRing();
+
+        // 31 - Method to create the swap chain
+        // Needs the logical device, so it has to happen after it.
+        if (config.headless)
+        {
+            createOffscreenTargets();
+        }
+        else
+        {
+            createSwapChain();
+        }
+
+        // 43 - Command pools, command buffers and sync objects per frame slot.
+        createFrameSlots();
+        createScenePipelineLayout();
+        buildRenderGraph();
+        if (config.gpuProfile)
+        {
+            gpuProfiler.init(physicalDevice, device, queueFamilyIndexes.graphicsFamily.value(), config.framesInFlight);
+        }
+        if (config.recordThreads > 0)
+        {
+            recorder.init(device, queueFamilyIndexes.graphicsFamily.value(), config.recordThreads, config.framesInFlight);
+        }
+
+        // No pipeline is built through the cache yet, so warm or cold only
+        // changes reading and validating the cache file, not pipeline creation.
+        double startupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupBegin).count();
+        biniutils::logstdout("Startup took " + std::to_string(startupMs) + " ms with a " + (pipelineCacheWarm ? "warm" : "cold") +
+                             " pipeline cache (only its file I/O, no pipelines are created through it yet)");
+
+        // 11 - Create surface where we are going to be drawing.
+        // We are going to use a Vulkan Extension - VK_KHR_surface para interactuar con una ventana.
+        // VkSurfaceKHR surface;
+    }
+
+    void createSwapChain()
+    {
+        CPU_ZONE("createSwapChain");
+        SwapChainSupportDetails swapChainSupport = querySwapChainSupport(physicalDevice);
+
+        // Retrieve the 3 values we just made methods for.
+        VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);
+        VkPresentModeKHR presentMode = chooseSwapPresentMode(swapChainSupport.presentModes);
+        VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
+
+        // Establish the amount of images within the swap chain.
+        uint32_t imageCount = chooseSwapImageCount(swapChainSupport.capabilities);
+
+        VkSwapchainCreateInfoKHR createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+        createInfo.surface = surface;
+        createInfo.minImageCount = imageCount;
+        createInfo.imageFormat = surfaceFormat.format;
+        createInfo.imageColorSpace = surfaceFormat.colorSpace;
+        createInfo.imageExtent = extent;
+        createInfo.imageArrayLayers = 1;
+        createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+        // The transient demo blits into the images, nothing else needs more.
+        swapChainTransferDst = config.transientDemo && (swapChainSupport.capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+        if (swapChainTransferDst)
+        {
+            createInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        }
+        createInfo.presentMode = presentMode;
+
+        // Get queue families and determine ownership of images in the swap chain.
+        const QueueFamilyIndexes &indices = queueFamilyIndexes;
+        uint32_t queueFamilyIndices[] = {indices.graphicsFamily.value(), indices.presentFamily.value()};
+
+        // 2 possibilities, they are the same family, or not.
+        if (indices.graphicsFamily != indices.presentFamily)
+        {
+            createInfo.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
+            createInfo.queueFamilyIndexCount = 2;
+            createInfo.pQueueFamilyIndices = queueFamilyIndices;
+        }
+        else
+        {
+            createInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            createInfo.queueFamilyIndexCount = 0;     // Optional
+            createInfo.pQueueFamilyIndices = nullptr; // Optional
+        }
+
+        // Apply transformation already done to the world.
+        createInfo.preTransform = swapChainSupport.capabilities.currentTransform;
+
+        // Is there a need to blend?
+        createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+
+        createInfo.presentMode = presentMode;
+        createInfo.clipped = VK_TRUE;
+        // When recreating, handing over the old swap chain lets the driver reuse
+        // its resources and keep presenting the images that are still queued.
+        createInfo.oldSwapchain = swapChain;
+
+        // 108 - Ask for mutable format images when we can view them in the
+        // counterpart format too. The list tells the driver which formats, so
+        // it can keep whatever compression works for both.
+        VkFormat viewFormats[] = {surfaceFormat.format, alternateViewFormat(surfaceFormat.format)};
+        VkImageFormatListCreateInfo formatList{};
+        swapChainAlternateFormat = VK_FORMAT_UNDEFINED;
+        if (deviceCapabilities.extensions.has(DeviceExtension::SwapchainMutableFormat) && viewFormats[1] != VK_FORMAT_UNDEFINED)
+        {
+            formatList.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_LIST_CREATE_INFO;
+            formatList.viewFormatCount = 2;
+            formatList.pViewFormats = viewFormats;
+            createInfo.pNext = &formatList;
+            createInfo.flags |= VK_SWAPCHAIN_CREATE_MUTABLE_FORMAT_BIT_KHR;
+            swapChainAlternateFormat = viewFormats[1];
+        }
+
+        if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain) != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to create swap chain!");
+        }
+
+        // 36 - Save references to images that are going to be used.
+        vkGetSwapchainImagesKHR(device, swapChain, &imageCount, nullptr);
+        swapChainImages.resize(imageCount);
+        vkGetSwapchainImagesKHR(device, swapChain, &imageCount, swapChainImages.data());
+
+        // 38 - After declare we save the attributes
+        swapChainImageFormat = surfaceFormat.format;
+        swapChainExtent = extent;
+        swapChainPresentMode = presentMode;
+        createSwapChainImageViews();
+        BINI_LOG(Info, SwapChain, std::string("Present policy ") + presentPolicyName(config.presentPolicy) + " uses " + presentModeName(presentMode) +
+                                  ", " + std::to_string(imageCount) + " images (asked for " + std::to_string(desiredImageCount) + ")");
+
+        // The number of images is only known now, create what depends on it.
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        renderFinishedSemaphores.resize(imageCount);
+        for (auto &semaphore : renderFinishedSemaphores)
+        {
+            if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &semaphore) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create render finished semaphore!");
+            }
+        }
+        imagesInFlight.assign(imageCount, GpuTimeline::Point{});
+    }
+
+    // Once per swap chain, right after its images are fetched. The views
+    // retire with their swap chain and are destroyed together with it.
+    void createSwapChainImageViews()
+    {
+        auto createView = [this](VkImage image, VkFormat format)
+        {
+            VkImageViewCreateInfo viewInfo{};
+            viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+            viewInfo.image = image;
+            viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+            viewInfo.format = format;
+            viewInfo.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+            VkImageView view;
+            if (vkCreateImageView(device, &viewInfo, nullptr, &view) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create swap chain image view!");
+            }
+            return view;
+        };
+
+        swapChainImageViews.resize(swapChainImages.size());
+        swapChainAlternateViews.resize(swapChainAlternateFormat != VK_FORMAT_UNDEFINED ? swapChainImages.size() : 0);
+        for (size_t i = 0; i < swapChainImages.size(); i++)
+        {
+            swapChainImageViews[i] = createView(swapChainImages[i], swapChainImageFormat);
+            renderingPath.prepare({swapChainImageViews[i], swapChainImageFormat, swapChainExtent});
+        }
+        for (size_t i = 0; i < swapChainAlternateViews.size(); i++)
+        {
+            swapChainAlternateViews[i] = createView(swapChainImages[i], swapChainAlternateFormat);
+        }
+    }
+
+    // Framebuffers made with a view go before the view itself.
+    void destroySwapChainImageViews(std::vector<VkImageView> &views)
+    {
+        for (auto view : views)
+        {
+            renderingPath.forgetView(view);
+            vkDestroyImageView(device, view, nullptr);
+        }
+        views.clear();
+    }
+
+    // The view of a swap chain image in the given format, VK_NULL_HANDLE when
+    // the image can't be seen in that format.
+    VkImageView swapChainView(uint32_t imageIndex, VkFormat format) const
+    {
+        if (format == swapChainImageFormat)
+        {
+            return swapChainImageViews[imageIndex];
+        }
+        if (format == swapChainAlternateFormat && format != VK_FORMAT_UNDEFINED)
+        {
+            return swapChainAlternateViews[imageIndex];
+        }
+        return VK_NULL_HANDLE;
+    }
+
+    // The sRGB format for a UNORM one and the other way around, if the device
+    // can render into it. VK_FORMAT_UNDEFINED for anything else.
+    VkFormat alternateViewFormat(VkFormat format)
+    {
+        const std::pair<VkFormat, VkFormat> pairs[] = {
+            {VK_FORMAT_B8G8R8A8_UNORM, VK_FORMAT_B8G8R8A8_SRGB},
+            {VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_R8G8B8A8_SRGB},
+            {VK_FORMAT_A8B8G8R8_UNORM_PACK32, VK_FORMAT_A8B8G8R8_SRGB_PACK32}};
+        for (const auto &[unorm, srgb] : pairs)
+        {
+            if (format == unorm || format == srgb)
+            {
+                VkFormat alternate = format == unorm ? srgb : unorm;
+                VkFormatProperties properties;
+                vkGetPhysicalDeviceFormatProperties(physicalDevice, alternate, &properties);
+                return (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT) ? alternate : VK_FORMAT_UNDEFINED;
+            }
+        }
+        return VK_FORMAT_UNDEFINED;
+    }
+
+    // 68 - How deep the swap chain is. Double buffering has the least latency,
+    // every extra image lets the CPU and GPU run further ahead of the display.
+    uint32_t chooseSwapImageCount(const VkSurfaceCapabilitiesKHR &capabilities)
+    {
+        minSwapChainImages = capabilities.minImageCount;
+        // 0 means the surface has no maximum, we still don't want to go crazy.
+        maxSwapChainImages = capabilities.maxImageCount > 0 ? capabilities.maxImageCount : std::max(capabilities.minImageCount, 8u);
+
+        if (desiredImageCount == 0)
+        {
+            desiredImageCount = config.swapChainImages > 0 ? config.swapChainImages : config.framesInFlight + 1;
+        }
+        uint32_t imageCount = std::clamp(desiredImageCount, minSwapChainImages, maxSwapChainImages);
+        if (imageCount != desiredImageCount)
+        {
+            BINI_LOG(Warning, SwapChain, "Swap chain images clamped from " + std::to_string(desiredImageCount) + " to " + std::to_string(imageCount) +
+                                         ", the surface allows " + std::to_string(minSwapChainImages) + " to " + std::to_string(maxSwapChainImages));
+            desiredImageCount = imageCount;
+        }
+        return imageCount;
+    }
+
+    // Feed the acquire stall of a frame to the tuner and apply what it suggests.
+    void tuneImageCount(double stallMs)
+    {
+        int change = imageCountTuner.addSample(stallMs);
+        if (change == 0)
+        {
+            return;
+        }
+        uint32_t newCount = std::clamp(static_cast<uint32_t>(static_cast<int>(desiredImageCount) + change), minSwapChainImages, maxSwapChainImages);
+        if (newCount == desiredImageCount)
+        {
+            // Already at the limit of the surface, nothing to compare next time.
+            imageCountTuner.lastChange = 0;
+            return;
+        }
+        BINI_LOG(Info, SwapChain, "Average acquire stall " + std::to_string(imageCountTuner.previousAverageMs) + " ms, swap chain images " +
+                                  std::to_string(desiredImageCount) + " -> " + std::to_string(newCount));
+        desiredImageCount = newCount;
+        imageCountChanged = true;
+    }
+
+    // 62 - Build a new swap chain for the current window size. No wait for the
+    // GPU here, the old swap chain is retired and destroyed a few frames later.
+    void recreateSwapChain()
+    {
+        CPU_ZONE("recreateSwapChain");
+        // A minimized window has a 0x0 framebuffer, nothing to draw until it's back.
+        int width = 0, height = 0;
+        glfwGetFramebufferSize(window, &width, &height);
+        while (width == 0 || height == 0)
+        {
+            if (glfwWindowShouldClose(window))
+            {
+                return;
+            }
+            glfwWaitEvents();
+            glfwGetFramebufferSize(window, &width, &height);
+        }
+
+        // 60 - The GPU can still be working with the old images, the frame
+        // being recorded included. Its submit is the last that may use them.
+        deletionQueue.defer(gpuTimeline.next(GpuTimeline::Lane::Graphics),
+                            [this, oldSwapChain = swapChain, views = std::move(swapChainImageViews),
+                             alternateViews = std::move(swapChainAlternateViews),
+                             semaphores = std::move(renderFinishedSemaphores)]() mutable
+                            {
+                                for (auto semaphore : semaphores)
+                                {
+                                    vkDestroySemaphore(device, semaphore, nullptr);
+                                }
+                                destroySwapChainImageViews(views);
+                                destroySwapChainImageViews(alternateViews);
+                                vkDestroySwapchainKHR(device, oldSwapChain, nullptr);
+                            });
+        renderFinishedSemaphores.clear();
+        swapChainImageViews.clear();
+        swapChainAlternateViews.clear();
+
+        // swapChain still holds the old one here, it is passed as oldSwapchain.
+        createSwapChain();
+        framebufferResized = false;
+        presentPolicyChanged = false;
+        imageCountChanged = false;
+        BINI_LOG(Info, SwapChain, "Swap chain recreated: " + std::to_string(swapChainExtent.width) + "x" + std::to_string(swapChainExtent.height));
+    }
+
+    // 74 - Create the pipeline cache, seeded with the data of the last run when
+    // it was made by this same device and driver.
+    void createPipelineCache()
+    {
+        CPU_ZONE("createPipelineCache");
+        std::vector<char> data;
+        if (!config.pipelineCachePath.empty() && !config.coldStart)
+        {
+            std::ifstream file(config.pipelineCachePath, std::ios::binary | std::ios::ate);
+            if (file.is_open())
+            {
+                data.resize(static_cast<size_t>(file.tellg()));
+                file.seekg(0);
+                file.read(data.data(), static_cast<std::streamsize>(data.size()));
+                std::string problem = validatePipelineCache(data);
+                if (!problem.empty())
+                {
+                    BINI_LOG(Warning, Render, "Ignoring pipeline cache " + config.pipelineCachePath + ": " + problem);
+                    data.clear();
+                }
+            }
+        }
+
+        VkPipelineCacheCreateInfo createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+        createInfo.initialDataSize = data.size();
+        createInfo.pInitialData = data.empty() ? nullptr : data.data();
+        if (vkCreatePipelineCache(device, &createInfo, nullptr, &pipelineCache) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create pipeline cache!");
+        }
+        pipelineCacheWarm = !data.empty();
+        loadedPipelineCache = std::move(data);
+    }
+
+    // Drivers are supposed to reject foreign data themselves, but some crash on
+    // it, so we check the header against our device first. Empty means valid.
+    std::string validatePipelineCache(const std::vector<char> &data)
+    {
+        VkPipelineCacheHeaderVersionOne header;
+        if (data.size() < sizeof(header))
+        {
+            return "too small";
+        }
+        std::memcpy(&header, data.data(), sizeof(header));
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        if (header.headerSize < sizeof(header) || header.headerSize > data.size() || header.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE)
+        {
+            return "unknown header";
+        }
+        if (header.vendorID != properties.vendorID || header.deviceID != properties.deviceID)
+        {
+            return "made by another device";
+        }
+        if (std::memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+        {
+            return "made by another driver version";
+        }
+        return "";
+    }
+
+    // Write the cache next to the old one, sync it and move it over it. The
+    // data is on disk before the move. On POSIX the rename is atomic, so a
+    // crash or power loss leaves either the old or the new file, never half
+    // of one. On Windows MoveFileEx replaces the file and writes the move
+    // through, but isn't documented as atomic.
+    void savePipelineCache()
+    {
+        CPU_ZONE("savePipelineCache");
+        if (config.pipelineCachePath.empty() || pipelineCache == VK_NULL_HANDLE)
+        {
+            return;
+        }
+        size_t size = 0;
+        vkGetPipelineCacheData(device, pipelineCache, &size, nullptr);
+        std::vector<char> data(size);
+        if (size == 0 || vkGetPipelineCacheData(device, pipelineCache, &size, data.data()) != VK_SUCCESS)
+        {
+            return;
+        }
+        data.resize(size);
+        if (data == loadedPipelineCache)
+        {
+            return;
+        }
+
+        std::string temporaryPath = config.pipelineCachePath + ".tmp";
+        FILE *file = std::fopen(temporaryPath.c_str(), "wb");
+        if (file == nullptr)
+        {
+            BINI_LOG(Warning, Render, "Can't write pipeline cache to " + temporaryPath);
+            return;
+        }
+        bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+        written = std::fflush(file) == 0 && written;
+        written = written && biniutils::syncFile(file);
+        written = std::fclose(file) == 0 && written;
+        if (!written || !biniutils::replaceFile(temporaryPath, config.pipelineCachePath))
+        {
+            BINI_LOG(Warning, Render, "Failed to save pipeline cache to " + config.pipelineCachePath);
+            std::remove(temporaryPath.c_str());
+            return;
+        }
+        biniutils::syncDirectoryOf(config.pipelineCachePath);
+        BINI_LOG(Info, Render, "Saved " + std::to_string(data.size()) + " bytes of pipeline cache to " + config.pipelineCachePath);
+    }
+
+    // 77 - Copies run on the transfer family when the device has one, they
+    // don't have to wait behind the rendering there. Without one they use the
+    // lowest priority graphics queue so frame submits go first.
+    void createStagingRing()
+    {
+        CPU_ZONE("createStagingRing");
+        if (queueFamilyIndexes.transferFamily.has_value())
+        {
+            uint32_t family = queueFamilyIndexes.transferFamily.value();
+            stagingRing.init(device, memoryAllocator, gpuTimeline, getQueue(family, 0), family);
+        }
+        else
+        {
+            uint32_t family = queueFamilyIndexes.graphicsFamily.value();
+            stagingRing.init(device, memoryAllocator, gpuTimeline, getBackgroundQueue(family), family);
+        }
+    }
+
+    // Families that need to share a resource written by the staging ring.
+    // Resources used by both have to be created VK_SHARING_MODE_CONCURRENT.
+    std::vector<uint32_t> uploadSharingFamilies()
+    {
+        std::vector<uint32_t> families = {queueFamilyIndexes.graphicsFamily.value()};
+        if (queueFamilyIndexes.transferFamily.has_value())
+        {
+            families.push_back(queueFamilyIndexes.transferFamily.value());
+        }
+        return families;
+    }
+
+    // Upload --bench-upload megabytes into a device local buffer in 1 MiB
+    // pieces, the size of a typical texture or mesh, and report the rate.
+    void benchmarkUploads()
+    {
+        const VkDeviceSize chunkSize = 1024 * 1024;
+        const VkDeviceSize bufferSize = 64 * chunkSize;
+
+        std::vector<uint32_t> families = uploadSharingFamilies();
+        VkBufferCreateInfo bufferInfo{};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = bufferSize;
+        bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+        if (families.size() > 1)
+        {
+            bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+            bufferInfo.queueFamilyIndexCount = static_cast<uint32_t>(families.size());
+            bufferInfo.pQueueFamilyIndices = families.data();
+        }
+        else
+        {
+            bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        }
+        VkBuffer target;
+        if (vkCreateBuffer(device, &bufferInfo, nullptr, &target) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create upload benchmark buffer!");
+        }
+        MemoryAllocation targetMemory = memoryAllocator.allocateForBuffer(target, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+        std::vector<char> data(static_cast<size_t>(chunkSize));
+        for (size_t i = 0; i < data.size(); i++)
+        {
+            data[i] = static_cast<char>(i * 31);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        VkDeviceSize offset = 0;
+        for (uint32_t i = 0; i < config.benchUploadMegabytes; i++)
+        {
+            stagingRing.uploadToBuffer(target, offset, data.data(), chunkSize);
+            offset = (offset + chunkSize) % bufferSize;
+        }
+        stagingRing.waitIdle();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        BINI_LOG(Info, Memory, "Uploaded " + std::to_string(config.benchUploadMegabytes) + " MiB in " +
+                               std::to_string(seconds * 1000.0) + " ms: " +
+                               std::to_string(config.benchUploadMegabytes / seconds) + " MiB/s");
+
+        vkDestroyBuffer(device, target, nullptr);
+        memoryAllocator.free(targetMemory);
+    }
+
+    // 48 - Headless replacement of the swap chain. Device local images we
+    // render into exactly like we would into swap chain images.
+    void createOffscreenTargets()
+    {
+        CPU_ZONE("createOffscreenTargets");
+        swapChainImageFormat = VK_FORMAT_B8G8R8A8_UNORM;
+        swapChainExtent = {WIDTH, HEIGHT};
+        swapChainTransferDst = true;
+        // Our own images can always be mutable, the format list is only a hint.
+        swapChainAlternateFormat = alternateViewFormat(swapChainImageFormat);
+        VkFormat viewFormats[] = {swapChainImageFormat, swapChainAlternateFormat};
+        VkImageFormatListCreateInfo formatList{};
+        formatList.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_LIST_CREATE_INFO;
+        formatList.viewFormatCount = 2;
+        formatList.pViewFormats = viewFormats;
+
+        // One image per frame in flight so no frame waits for another.
+        swapChainImages.resize(config.framesInFlight);
+        offscreenImageMemory.resize(config.framesInFlight);
+
+        for (size_t i = 0; i < swapChainImages.size(); i++)
+        {
+            VkImageCreateInfo imageInfo{};
+            imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+            if (swapChainAlternateFormat != VK_FORMAT_UNDEFINED)
+            {
+                imageInfo.flags = VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
+                if (deviceCapabilities.extensions.has(DeviceExtension::ImageFormatList))
+                {
+                    imageInfo.pNext = &formatList;
+                }
+            }
+            imageInfo.imageType = VK_IMAGE_TYPE_2D;
+            imageInfo.format = swapChainImageFormat;
+            imageInfo.extent = {swapChainExtent.width, swapChainExtent.height, 1};
+            imageInfo.mipLevels = 1;
+            imageInfo.arrayLayers = 1;
+            imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+            imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+            // Same usage as the swap chain plus a way to read the result back.
+            imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+            imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            if (vkCreateImage(device, &imageInfo, nullptr, &swapChainImages[i]) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create offscreen image!");
+            }
+
+            offscreenImageMemory[i] = memoryAllocator.allocateForImage(swapChainImages[i], VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        }
+        createSwapChainImageViews();
+
+        imagesInFlight.assign(swapChainImages.size(), GpuTimeline::Point{});
+    }
+
+    void createFrameSlots()
+    {
+        CPU_ZONE("createFrameSlots");
+        const QueueFamilyIndexes &indexes = queueFamilyIndexes;
+        frames.resize(config.framesInFlight);
+
+        for (auto &frame : frames)
+        {
+            // Command buffers are short lived, the driver can optimize for that.
+            VkCommandPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            poolInfo.queueFamilyIndex = indexes.graphicsFamily.value();
+            if (vkCreateCommandPool(device, &poolInfo, nullptr, &frame.commandPool) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create command pool!");
+            }
+
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = frame.commandPool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = 1;
+            if (vkAllocateCommandBuffers(device, &allocInfo, &frame.commandBuffer) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to allocate command buffer!");
+            }
+
+            VkSemaphoreCreateInfo semaphoreInfo{};
+            semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &frame.imageAvailable) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create image available semaphore!");
+            }
+            if (!gpuTimeline.usesTimelineSemaphores() &&
+                vkCreateSemaphore(device, &semaphoreInfo, nullptr, &frame.uploadsDone) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to create uploads done semaphore!");
+            }
+
+            // Point 0 is always reached, the first wait of every slot returns right away.
+            frame.lastSubmit = {GpuTimeline::Lane::Graphics, 0};
+        }
+    }
+
+    // 44 - Record the work of a frame. The render graph takes care of every
+    // barrier, including getting the image ready to present.
+    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex)
+    {
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to begin recording command buffer!");
+        }
+
+        // The whole submission is a scope too, it includes the barriers in between.
+        gpuProfiler.beginFrame(commandBuffer, currentFrame);
+        gpuProfiler.beginScope(commandBuffer, "frame");
+        renderGraph.setImportedImage(backbuffer, swapChainImages[imageIndex]);
+        sceneTarget = {swapChainView(imageIndex, swapChainImageFormat), swapChainImageFormat, swapChainExtent};
+        renderGraph.execute(commandBuffer, &gpuProfiler);
+        gpuProfiler.endScope(commandBuffer);
+
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to record command buffer!");
+        }
+    }
+
+    // 84 - The passes of a frame. There is no pipeline yet, so the scene pass
+    // clears the image with a color that changes over time to see that frames
+    // are moving, then records the draws. The clear is the load op of the
+    // render pass / dynamic rendering the draws happen in.
+    void buildRenderGraph()
+    {
+        CPU_ZONE("buildRenderGraph");
+        renderGraph.init(device, memoryAllocator);
+        backbuffer = renderGraph.importImage("backbuffer", VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_UNDEFINED, ACQUIRE_WAIT_STAGES);
+
+        renderGraph.addPass("scene", {{backbuffer, ResourceUsage::ColorAttachment}}, [this](VkCommandBuffer commandBuffer, const RenderGraph &)
+                            {
+            float t = static_cast<float>(frameCount % 360) / 360.0f;
+            VkClearColorValue clearColor = {{t, 0.2f, 1.0f - t, 1.0f}};
+            bool secondaries = config.drawItems > 0 && recorder.threadCount() > 0;
+            renderingPath.begin(commandBuffer, sceneTarget, clearColor, secondaries);
+            recordScene(commandBuffer);
+            renderingPath.end(commandBuffer); });
+
+        if (config.transientDemo)
+        {
+            addTransientDemoPasses();
+        }
+
+        // Presented, or left ready to be read back when there is nothing to present.
+        renderGraph.setOutput(backbuffer, config.headless ? ResourceUsage::TransferSrc : ResourceUsage::Present);
+        renderGraph.compile();
+    }
+
+    // 86 - A -> B -> C -> swap chain through three transient images. A is
+    // dead once B has read it, so C gets A's memory. Blits stand in for the
+    // shaders of a real post processing chain.
+    void addTransientDemoPasses()
+    {
+        const VkExtent2D size = {256, 256};
+        RenderGraph::ImageDesc desc;
+        desc.format = VK_FORMAT_B8G8R8A8_UNORM;
+        desc.extent = size;
+        RenderGraph::Resource imageA = renderGraph.createImage("demo A", desc);
+        RenderGraph::Resource imageB = renderGraph.createImage("demo B", desc);
+        RenderGraph::Resource imageC = renderGraph.createImage("demo C", desc);
+
+        renderGraph.addPass("demo gradient", {{imageA, ResourceUsage::TransferDst}}, [this, imageA](VkCommandBuffer commandBuffer, const RenderGraph &graph)
+                            {
+            VkImageSubresourceRange range{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+            float t = static_cast<float>(frameCount % 120) / 120.0f;
+            VkClearColorValue clearColor = {{1.0f, t, 0.0f, 1.0f}};
+            vkCmdClearColorImage(commandBuffer, graph.image(imageA), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor, 1, &range); });
+
+        renderGraph.addPass("demo flip x", {{imageA, ResourceUsage::TransferSrc}, {imageB, ResourceUsage::TransferDst}},
+                            [this, imageA, imageB, size](VkCommandBuffer commandBuffer, const RenderGraph &graph)
+                            { blitImage(commandBuffer, graph.image(imageA), size, graph.image(imageB), {{static_cast<int32_t>(size.width), 0}, {0, static_cast<int32_t>(size.height)}}); });
+
+        renderGraph.addPass("demo flip y", {{imageB, ResourceUsage::TransferSrc}, {imageC, ResourceUsage::TransferDst}},
+                            [this, imageB, imageC, size](VkCommandBuffer commandBuffer, const RenderGraph &graph)
+                            { blitImage(commandBuffer, graph.image(imageB), size, graph.image(imageC), {{0, static_cast<int32_t>(size.height)}, {static_cast<int32_t>(size.width), 0}}); });
+
+        // Without blits into the backbuffer nothing reaches an output and the
+        // graph culls the whole chain.
+        VkFormatProperties formatProperties;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, swapChainImageFormat, &formatProperties);
+        if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_DST_BIT))
+        {
+            BINI_LOG(Warning, Render, "Swap chain format can't be blitted to, the transient demo is left out.");
+            return;
+        }
+        if (!swapChainTransferDst)
+        {
+            BINI_LOG(Warning, Render, "Swap chain images can't be a transfer destination, the transient demo is left out.");
+            return;
+        }
+        renderGraph.addPass("demo composite", {{imageC, ResourceUsage::TransferSrc}, {backbuffer, ResourceUsage::TransferDst}},
+                            [this, imageC, size](VkCommandBuffer commandBuffer, const RenderGraph &graph)
+                            {
+            int32_t width = static_cast<int32_t>(std::min(size.width, swapChainExtent.width));
+            int32_t height = static_cast<int32_t>(std::min(size.height, swapChainExtent.height));
+            blitImage(commandBuffer, graph.image(imageC), size, graph.image(backbuffer), {{0, 0}, {width, height}}); });
+    }
+
+    // Blit a whole image into the rectangle between two corners of another
+    // one, swapping the corners flips it.
+    void blitImage(VkCommandBuffer commandBuffer, VkImage source, VkExtent2D sourceSize, VkImage destination, std::pair<VkOffset2D, VkOffset2D> corners)
+    {
+        VkImageBlit region{};
+        region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+        region.srcOffsets[1] = {static_cast<int32_t>(sourceSize.width), static_cast<int32_t>(sourceSize.height), 1};
+        region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+        region.dstOffsets[0] = {corners.first.x, corners.first.y, 0};
+        region.dstOffsets[1] = {corners.second.x, corners.second.y, 1};
+        vkCmdBlitImage(commandBuffer, source, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, destination, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       1, &region, VK_FILTER_NEAREST);
+    }
+
+    void recordScene(VkCommandBuffer commandBuffer)
+    {
+        if (config.drawItems == 0)
+        {
+            return;
+        }
+        if (recorder.threadCount() > 0)
+        {
+            // Secondaries run inside the scene's rendering, they have to know about it.
+            RenderingPath::Inheritance inheritance;
+            renderingPath.fillInheritance(sceneTarget, inheritance);
+            const auto &secondaries = recorder.record(currentFrame, config.drawItems, [this](VkCommandBuffer secondary, uint32_t first, uint32_t count)
+                                                      { recordDraws(secondary, first, count); }, &inheritance.info);
+            vkCmdExecuteCommands(commandBuffer, static_cast<uint32_t>(secondaries.size()), secondaries.data());
+        }
+        else
+        {
+            recordDraws(commandBuffer, 0, config.drawItems);
+        }
+    }
+
+    // 80 - Per draw state of the scene. There are no shaders yet, so a draw
+    // is the push constants a real one would set (a transform per object);
+    // the vkCmdDraw follows once there is a pipeline to bind.
+    void recordDraws(VkCommandBuffer commandBuffer, uint32_t first, uint32_t count)
+    {
+        float transform[16] = {1.0f, 0.0f, 0.0f, 0.0f,
+                               0.0f, 1.0f, 0.0f, 0.0f,
+                               0.0f, 0.0f, 1.0f, 0.0f,
+                               0.0f, 0.0f, 0.0f, 1.0f};
+        for (uint32_t item = first; item < first + count; item++)
+        {
+            transform[12] = static_cast<float>(item % 100);
+            transform[13] = static_cast<float>(item / 100);
+            transform[14] = static_cast<float>(frameCount % 360);
+            vkCmdPushConstants(commandBuffer, scenePipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(transform), transform);
+        }
+    }
+
+    void createScenePipelineLayout()
+    {
+        // A 4x4 matrix, within the 128 bytes every device guarantees.
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = 16 * sizeof(float);
+
+        VkPipelineLayoutCreateInfo layoutInfo{};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        layoutInfo.pushConstantRangeCount = 1;
+        layoutInfo.pPushConstantRanges = &pushConstantRange;
+        if (vkCreatePipelineLayout(device, &layoutInfo, nullptr, &scenePipelineLayout) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create pipeline layout!");
+        }
+    }
+
+    // Record the draws of a frame on the main thread and then with 1, 2, 4...
+    // workers up to the number of cores. Only recording is timed, nothing is
+    // submitted.
+    void benchmarkRecording()
+    {
+        const uint32_t iterations = 200;
+        uint32_t items = config.drawItems > 0 ? config.drawItems : 10000;
+
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        poolInfo.queueFamilyIndex = queueFamilyIndexes.graphicsFamily.value();
+        VkCommandPool pool;
+        if (vkCreateCommandPool(device, &poolInfo, nullptr, &pool) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create benchmark command pool!");
+        }
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = pool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+        VkCommandBuffer primary;
+        if (vkAllocateCommandBuffers(device, &allocInfo, &primary) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allocate benchmark command buffer!");
+        }
+
+        std::vector<uint32_t> threadCounts = {0};
+        uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+        for (uint32_t threads = 1; threads < cores; threads *= 2)
+        {
+            threadCounts.push_back(threads);
+        }
+        threadCounts.push_back(cores);
+
+        double baselineMs = 0.0;
+        for (uint32_t threads : threadCounts)
+        {
+            ParallelRecorder benchRecorder;
+            benchRecorder.init(device, queueFamilyIndexes.graphicsFamily.value(), threads, config.framesInFlight);
+            ParallelRecorder::RecordFunction function = [this](VkCommandBuffer secondary, uint32_t first, uint32_t count)
+            { recordDraws(secondary, first, count); };
+
+            auto start = std::chrono::steady_clock::now();
+            for (uint32_t i = 0; i < iterations; i++)
+            {
+                vkResetCommandPool(device, pool, 0);
+                VkCommandBufferBeginInfo beginInfo{};
+                beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+                beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+                vkBeginCommandBuffer(primary, &beginInfo);
+                if (threads == 0)
+                {
+                    recordDraws(primary, 0, items);
+                }
+                else
+                {
+                    const auto &secondaries = benchRecorder.record(i % config.framesInFlight, items, function);
+                    vkCmdExecuteCommands(primary, static_cast<uint32_t>(secondaries.size()), secondaries.data());
+                }
+                vkEndCommandBuffer(primary);
+            }
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+            benchRecorder.cleanup();
+
+            if (threads == 0)
+            {
+                baselineMs = ms;
+            }
+            BINI_LOG(Info, Render, "Recording " + std::to_string(items) + " draws with " +
+                                   (threads == 0 ? std::string("the main thread") : std::to_string(threads) + " thread(s)") + ": " +
+                                   std::to_string(ms) + " ms/frame, speedup " + std::to_string(baselineMs / ms) + "x");
+        }
+
+        vkDestroyCommandPool(device, pool, nullptr);
+    }
+
+    // 45 - Acquire, record, submit and present one frame.
+    void drawFrame()
+    {
+        CPU_ZONE("drawFrame");
+        FrameSlot &frame = frames[currentFrame];
+
+        // Only wait for the GPU to be done with this slot, not with everything.
+        {
+            CPU_ZONE("wait for frame slot");
+            gpuTimeline.wait(frame.lastSubmit);
+        }
+        deletionQueue.collect();
+
+        // Uploads recorded since the last frame go out in a single submit.
+        // Without timeline semaphores that waits until right before the frame
+        // submit, a binary semaphore signaled now could be left unwaited by
+        // an early return.
+        bool timelineUploads = gpuTimeline.usesTimelineSemaphores();
+        if (timelineUploads)
+        {
+            stagingRing.flush();
+        }
+
+        // The slot's submit is done, so its timestamps are written.
+        gpuProfiler.collect(currentFrame);
+
+        uint32_t imageIndex;
+        if (config.headless)
+        {
+            // Our own images, simply go round robin.
+            imageIndex = nextOffscreenImage;
+            nextOffscreenImage = (nextOffscreenImage + 1) % static_cast<uint32_t>(swapChainImages.size());
+        }
+        else
+        {
+            CPU_ZONE("acquire");
+            auto acquireStart = std::chrono::steady_clock::now();
+            VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, frame.imageAvailable, VK_NULL_HANDLE, &imageIndex);
+            if (config.autoTuneImages)
+            {
+                tuneImageCount(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - acquireStart).count());
+            }
+            // Out of date, nothing can be presented to this swap chain anymore.
+            // Suboptimal still works and signals the semaphore, so we keep going.
+            if (result == VK_ERROR_OUT_OF_DATE_KHR)
+            {
+                recreateSwapChain();
+                return;
+            }
+            if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
+            {
+                throw std::runtime_error("Failed to acquire swap chain image!");
+            }
+        }
+
+        // With more frames in flight than images, another slot might still be
+        // rendering to this image.
+        if (!gpuTimeline.reached(imagesInFlight[imageIndex]))
+        {
+            CPU_ZONE("wait for image");
+            gpuTimeline.wait(imagesInFlight[imageIndex]);
+        }
+
+        {
+            CPU_ZONE("record");
+            vkResetCommandPool(device, frame.commandPool, 0);
+            recordCommandBuffer(frame.commandBuffer, imageIndex);
+        }
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &frame.commandBuffer;
+        GpuTimeline::Submit sync;
+        // Headless frames have no acquire to wait for and no present to signal.
+        if (!config.headless)
+        {
+            sync.wait(frame.imageAvailable, ACQUIRE_WAIT_STAGES);
+            sync.signal(renderFinishedSemaphores[imageIndex]);
+        }
+        // Uploads are ordered on the GPU, the CPU never waits for them here.
+        if (timelineUploads)
+        {
+            gpuTimeline.waitOnGpu(sync, stagingRing.lastUpload(), VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+        }
+        else if (stagingRing.flush(frame.uploadsDone))
+        {
+            // Signaled after every earlier submit of the ring's queue.
+            sync.wait(frame.uploadsDone, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+        }
+        else
+        {
+            // Nothing new, only uploads flushed earlier (a full ring). Those
+            // have a fence, normally long signaled.
+            gpuTimeline.wait(stagingRing.lastUpload());
+        }
 
-        if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain) != VK_SUCCESS)
         {
-            throw std::runtime_error("failed to create swap chain!");
+            CPU_ZONE("submit");
+            gpuTimeline.prepare(GpuTimeline::Lane::Graphics, sync);
+            sync.fill(submitInfo);
+            if (submitToQueue(getQueue(queueFamilyIndexes.graphicsFamily.value(), 0), 1, &submitInfo, sync.fence) != VK_SUCCESS)
+            {
+                throw std::runtime_error("Failed to submit draw command buffer!");
+            }
         }
+        frame.lastSubmit = sync.point;
+        imagesInFlight[imageIndex] = sync.point;
 
-        // 36 - Save references to images that are going to be used.
-        vkGetSwapchainImagesKHR(device, swapChain, &imageCount, nullptr);
-        swapChainImages.resize(imageCount);
-        vkGetSwapchainImagesKHR(device, swapChain, &imageCount, swapChainImages.data());
+        if (!config.headless)
+        {
+            CPU_ZONE("present");
+            VkPresentInfoKHR presentInfo{};
+            presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+            presentInfo.waitSemaphoreCount = 1;
+            presentInfo.pWaitSemaphores = &renderFinishedSemaphores[imageIndex];
+            presentInfo.swapchainCount = 1;
+            presentInfo.pSwapchains = &swapChain;
+            presentInfo.pImageIndices = &imageIndex;
+            VkResult result;
+            {
+                // Presenting uses the queue too, so it takes the same lock.
+                std::lock_guard<std::mutex> lock(*getQueue(queueFamilyIndexes.presentFamily.value(), 0).lock);
+                result = vkQueuePresentKHR(presentQueue, &presentInfo);
+            }
 
-        // 38 - After declare we save the attributes
-        swapChainImageFormat = surfaceFormat.format;
-        swapChainExtent = extent;
+            // Suboptimal during a drag is fine, we wait for the size to settle.
+            // Without a resize event (rotation, monitor change) we rebuild now.
+            bool resizeSettled = framebufferResized && std::chrono::steady_clock::now() - lastResizeEvent >= RESIZE_DEBOUNCE;
+            if (result == VK_ERROR_OUT_OF_DATE_KHR || (result == VK_SUBOPTIMAL_KHR && !framebufferResized) || resizeSettled || presentPolicyChanged || imageCountChanged)
+            {
+                recreateSwapChain();
+            }
+            else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
+            {
+                throw std::runtime_error("Failed to present swap chain image!");
+            }
+        }
+
+        currentFrame = (currentFrame + 1) % config.framesInFlight;
+        frameCount++;
     }
 
     void createSurface()
     {
+        CPU_ZONE("createSurface");
         if (glfwCreateWindowSurface(instance, window, nullptr, &surface) != VK_SUCCESS)
         {
             throw std::runtime_error("Problem creating the surface");
@@ -234,23 +5726,38 @@ private:
 
     void createLogicalDevice()
     {
+        CPU_ZONE("createLogicalDevice");
         // Get the families.
         QueueFamilyIndexes indexes = findQueueFamilies(physicalDevice);
 
         // 20 - Changes made in order to consider several queues.
         std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-        std::set<uint32_t> uniqueQueueFamilies = {indexes.graphicsFamily.value(), indexes.presentFamily.value()};
+        std::set<uint32_t> uniqueQueueFamilies = {indexes.graphicsFamily.value()};
+        for (const auto &family : {indexes.presentFamily, indexes.computeFamily, indexes.transferFamily})
+        {
+            if (family.has_value())
+            {
+                uniqueQueueFamilies.insert(family.value());
+            }
+        }
 
-        // Not messing around with these yet.
-        float queuePriority = 1.0f;
+        // 57 - Several queues per family, as many priorities as we configured
+        // but never more than the family has.
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
 
         for (uint32_t queueFamily : uniqueQueueFamilies)
         {
+            uint32_t queueCount = std::min(static_cast<uint32_t>(config.queuePriorities.size()), queueFamilies[queueFamily].queueCount);
+
             VkDeviceQueueCreateInfo queueCreateInfo{};
             queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
             queueCreateInfo.queueFamilyIndex = queueFamily;
-            queueCreateInfo.queueCount = 1;
-            queueCreateInfo.pQueuePriorities = &queuePriority;
+            queueCreateInfo.queueCount = std::max(queueCount, 1u);
+            // Priorities are sorted, so the first queues are the most important.
+            queueCreateInfo.pQueuePriorities = config.queuePriorities.data();
 
             // Push the newly created VkDeviceQueueCreateInfo struct into the vector
             queueCreateInfos.push_back(queueCreateInfo);
@@ -269,8 +5776,119 @@ private:
         queueCreateInfo.pQueuePriorities = &queuePriority;
         */
 
-        // Struct that defines the requirements on the physical device. Nothing special at the moment.
-        VkPhysicalDeviceFeatures deviceFeatures{};
+        // 98 - Features go through a VkPhysicalDeviceFeatures2 chain, first to
+        // ask what the device has and then to enable what we use of it.
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        uint32_t apiVersion = std::min(properties.apiVersion, instanceApiVersion);
+
+        // 101 - Optional extensions the device has and that aren't core for it.
+        DeviceExtensionSet available = availableDeviceExtensions(physicalDevice);
+        DeviceExtensionSet candidates;
+        for (uint32_t i = 0; i < static_cast<uint32_t>(DeviceExtension::Count); i++)
+        {
+            const DeviceExtensionInfo &info = deviceExtensionInfos[i];
+            bool core = info.promotedIn != 0 && apiVersion >= info.promotedIn;
+            if (available.has(static_cast<DeviceExtension>(i)) && !info.required && !core &&
+                apiVersion >= info.minApiVersion && !(info.presentOnly && config.headless))
+            {
+                candidates.add(static_cast<DeviceExtension>(i));
+            }
+        }
+
+        DeviceFeatureChain supported;
+        supported.link(apiVersion, candidates);
+        if (apiVersion >= VK_API_VERSION_1_1)
+        {
+            vkGetPhysicalDeviceFeatures2(physicalDevice, &supported.features2);
+        }
+
+        // Only what we have a use for, enabling everything can cost performance.
+        DeviceFeatureChain enabled;
+        enabled.vulkan12.timelineSemaphore = supported.vulkan12.timelineSemaphore;
+        enabled.vulkan12.bufferDeviceAddress = supported.vulkan12.bufferDeviceAddress;
+        // Descriptor indexing is only useful to us as bindless textures, so all or nothing.
+        bool bindless = supported.vulkan12.descriptorIndexing && supported.vulkan12.runtimeDescriptorArray &&
+                        supported.vulkan12.descriptorBindingPartiallyBound && supported.vulkan12.descriptorBindingVariableDescriptorCount &&
+                        supported.vulkan12.shaderSampledImageArrayNonUniformIndexing;
+        enabled.vulkan12.descriptorIndexing = bindless;
+        enabled.vulkan12.runtimeDescriptorArray = bindless;
+        enabled.vulkan12.descriptorBindingPartiallyBound = bindless;
+        enabled.vulkan12.descriptorBindingVariableDescriptorCount = bindless;
+        enabled.vulkan12.shaderSampledImageArrayNonUniformIndexing = bindless;
+        enabled.vulkan13.synchronization2 = supported.vulkan13.synchronization2;
+        enabled.vulkan13.dynamicRendering = supported.vulkan13.dynamicRendering;
+        enabled.vulkan13.pipelineCreationCacheControl = supported.vulkan13.pipelineCreationCacheControl;
+        enabled.vulkan13.maintenance4 = supported.vulkan13.maintenance4;
+
+        // An optional extension is only worth enabling when its feature is there too.
+        DeviceExtensionSet extensions = requiredDeviceExtensions();
+        auto enableIf = [&candidates, &extensions](DeviceExtension extension, VkBool32 supportedFeature, VkBool32 &enabledFeature)
+        {
+            if (candidates.has(extension) && supportedFeature)
+            {
+                enabledFeature = VK_TRUE;
+                extensions.add(extension);
+            }
+        };
+        enableIf(DeviceExtension::TimelineSemaphore, supported.timelineSemaphore.timelineSemaphore, enabled.timelineSemaphore.timelineSemaphore);
+        enableIf(DeviceExtension::Synchronization2, supported.synchronization2.synchronization2, enabled.synchronization2.synchronization2);
+        enableIf(DeviceExtension::DynamicRendering, supported.dynamicRendering.dynamicRendering, enabled.dynamicRendering.dynamicRendering);
+        enableIf(DeviceExtension::PipelineCreationCacheControl, supported.pipelineCreationCacheControl.pipelineCreationCacheControl,
+                 enabled.pipelineCreationCacheControl.pipelineCreationCacheControl);
+        enableIf(DeviceExtension::Maintenance4, supported.maintenance4.maintenance4, enabled.maintenance4.maintenance4);
+        enableIf(DeviceExtension::PresentId, supported.presentId.presentId, enabled.presentId.presentId);
+        // Present wait waits on present ids, it's useless without them.
+        enableIf(DeviceExtension::PresentWait, supported.presentWait.presentWait && extensions.has(DeviceExtension::PresentId),
+                 enabled.presentWait.presentWait);
+        if (candidates.has(DeviceExtension::MemoryBudget))
+        {
+            extensions.add(DeviceExtension::MemoryBudget);
+        }
+        // Mutable swap chain formats take a format list, core since 1.2.
+        bool formatLists = apiVersion >= VK_API_VERSION_1_2 || candidates.has(DeviceExtension::ImageFormatList);
+        if (candidates.has(DeviceExtension::ImageFormatList))
+        {
+            extensions.add(DeviceExtension::ImageFormatList);
+        }
+        if (candidates.has(DeviceExtension::SwapchainMutableFormat) && formatLists)
+        {
+            extensions.add(DeviceExtension::SwapchainMutableFormat);
+        }
+        enabled.link(apiVersion, extensions);
+
+        // Publish what we got, core or extension doesn't matter past this point.
+        deviceCapabilities = DeviceCapabilities{};
+        deviceCapabilities.apiVersion = apiVersion;
+        deviceCapabilities.extensions = extensions;
+        if (apiVersion >= VK_API_VERSION_1_2 && enabled.vulkan12.timelineSemaphore)
+        {
+            deviceCapabilities.extensions.add(DeviceExtension::TimelineSemaphore);
+        }
+        if (apiVersion >= VK_API_VERSION_1_2)
+        {
+            deviceCapabilities.extensions.add(DeviceExtension::ImageFormatList);
+        }
+        if (apiVersion >= VK_API_VERSION_1_3)
+        {
+            const std::pair<VkBool32, DeviceExtension> promoted[] = {
+                {enabled.vulkan13.synchronization2, DeviceExtension::Synchronization2},
+                {enabled.vulkan13.dynamicRendering, DeviceExtension::DynamicRendering},
+                {enabled.vulkan13.pipelineCreationCacheControl, DeviceExtension::PipelineCreationCacheControl},
+                {enabled.vulkan13.maintenance4, DeviceExtension::Maintenance4}};
+            for (const auto &[feature, extension] : promoted)
+            {
+                if (feature)
+                {
+                    deviceCapabilities.extensions.add(extension);
+                }
+            }
+        }
+        deviceCapabilities.timelineSemaphore = deviceCapabilities.extensions.has(DeviceExtension::TimelineSemaphore);
+        deviceCapabilities.synchronization2 = deviceCapabilities.extensions.has(DeviceExtension::Synchronization2);
+        deviceCapabilities.dynamicRendering = deviceCapabilities.extensions.has(DeviceExtension::DynamicRendering);
+        deviceCapabilities.bufferDeviceAddress = apiVersion >= VK_API_VERSION_1_2 && enabled.vulkan12.bufferDeviceAddress;
+        deviceCapabilities.descriptorIndexing = apiVersion >= VK_API_VERSION_1_2 && enabled.vulkan12.descriptorIndexing;
 
         VkDeviceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -281,13 +5899,23 @@ private:
 
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
         createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
-        createInfo.pEnabledFeatures = &deviceFeatures;
+        // A 1.0 device only takes the plain struct, newer ones the chain.
+        // No 1.0 features needed, features2.features stays empty.
+        if (apiVersion >= VK_API_VERSION_1_1)
+        {
+            createInfo.pNext = &enabled.features2;
+        }
+        else
+        {
+            createInfo.pEnabledFeatures = &enabled.features2.features;
+        }
         // 24 - Modify create info to consider extension support in the logical device.
-        createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-        createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+        std::vector<const char *> extensionNames = extensions.names();
+        createInfo.enabledExtensionCount = static_cast<uint32_t>(extensionNames.size());
+        createInfo.ppEnabledExtensionNames = extensionNames.data();
 
         // We add layers to validate in logical device.
-        if (enableValidationLayers)
+        if (config.validation)
         {
             createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
             createInfo.ppEnabledLayerNames = validationLayers.data();
@@ -302,12 +5930,69 @@ private:
         {
             throw std::runtime_error("Failed to create logical device!");
         }
+        BINI_LOG(Info, Device, "Device capabilities: " + deviceCapabilities.describe());
+
+        // Every queue of every family, so other threads can pick one by priority.
+        familyQueues.clear();
+        for (const auto &queueCreateInfo : queueCreateInfos)
+        {
+            auto &queues = familyQueues[queueCreateInfo.queueFamilyIndex];
+            queues.resize(queueCreateInfo.queueCount);
+            for (uint32_t index = 0; index < queueCreateInfo.queueCount; index++)
+            {
+                vkGetDeviceQueue(device, queueCreateInfo.queueFamilyIndex, index, &queues[index].queue);
+                queues[index].priority = queueCreateInfo.pQueuePriorities[index];
+            }
+            BINI_LOG(Debug, Device, "Family " + std::to_string(queueCreateInfo.queueFamilyIndex) + ": " +
+                                    std::to_string(queueCreateInfo.queueCount) + " queue(s)");
+        }
 
         // Get graphics queue reference to use on the future.
-        vkGetDeviceQueue(device, 0, indexes.graphicsFamily.value(), &graphicsQueue);
+        // Parameters are family first and then the index of the queue inside it.
+        vkGetDeviceQueue(device, indexes.graphicsFamily.value(), 0, &graphicsQueue);
 
         // 22 - Same as we did with the graphics queue, we retrieve the reference for the presentation queue
-        vkGetDeviceQueue(device, 0, indexes.presentFamily.value(), &presentQueue);
+        if (indexes.presentFamily.has_value())
+        {
+            vkGetDeviceQueue(device, indexes.presentFamily.value(), 0, &presentQueue);
+        }
+
+        // 54 - Dedicated queues, or the graphics queue when there is no such family.
+        computeQueue = graphicsQueue;
+        if (indexes.computeFamily.has_value())
+        {
+            vkGetDeviceQueue(device, indexes.computeFamily.value(), 0, &computeQueue);
+        }
+        transferQueue = graphicsQueue;
+        if (indexes.transferFamily.has_value())
+        {
+            vkGetDeviceQueue(device, indexes.transferFamily.value(), 0, &transferQueue);
+        }
+        BINI_LOG(Info, Device, std::string("Async compute: ") + (indexes.computeFamily.has_value() ? "dedicated family " + std::to_string(indexes.computeFamily.value()) : "graphics queue") +
+                               ", transfers: " + (indexes.transferFamily.has_value() ? "dedicated family " + std::to_string(indexes.transferFamily.value()) : "graphics queue"));
+
+        queueFamilyIndexes = indexes;
+    }
+
+    // 58 - Queue of a family by priority rank, 0 is the highest. Families that
+    // got fewer queues hand out their lowest priority one.
+    PriorityQueue &getQueue(uint32_t family, uint32_t rank)
+    {
+        auto &queues = familyQueues.at(family);
+        return queues[std::min<size_t>(rank, queues.size() - 1)];
+    }
+
+    // The lowest priority queue of a family, for streaming and other background work.
+    PriorityQueue &getBackgroundQueue(uint32_t family)
+    {
+        return familyQueues.at(family).back();
+    }
+
+    // Submit holding only the lock of that queue.
+    VkResult submitToQueue(PriorityQueue &queue, uint32_t submitCount, const VkSubmitInfo *submits, VkFence fence)
+    {
+        std::lock_guard<std::mutex> lock(*queue.lock);
+        return vkQueueSubmit(queue.queue, submitCount, submits, fence);
     }
 
     // 26 - Implement method to return populated chain swap detail struct.
@@ -374,13 +6059,32 @@ private:
     // If the queue was empty, it sends it right awayt. Causes Screen Tearing.
     // VK_PRESENT_MODE_MAILBOX_KHR
     // Queue, gets the first one, substitutes frames instead of wait.
+    // 65 - Each policy has its modes in order of preference. FIFO is always
+    // supported, so it closes every list.
     VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR> &availablePresentModes)
     {
-        for (const auto &availablePresentMode : availablePresentModes)
+        std::vector<VkPresentModeKHR> preferred;
+        switch (config.presentPolicy)
+        {
+        case PresentPolicy::LowestLatency:
+            // Relaxed still shows a late frame right away instead of waiting a full interval.
+            preferred = {VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR};
+            break;
+        case PresentPolicy::PowerSaving:
+            break;
+        case PresentPolicy::TearFreeThroughput:
+            preferred = {VK_PRESENT_MODE_MAILBOX_KHR};
+            break;
+        case PresentPolicy::UncappedBenchmark:
+            preferred = {VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR};
+            break;
+        }
+
+        for (auto mode : preferred)
         {
-            if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR)
+            if (std::find(availablePresentModes.begin(), availablePresentModes.end(), mode) != availablePresentModes.end())
             {
-                return availablePresentMode;
+                return mode;
             }
         }
         return VK_PRESENT_MODE_FIFO_KHR;
@@ -409,6 +6113,7 @@ private:
 
     void pickPhysicalDevice()
     {
+        CPU_ZONE("pickPhysicalDevice");
         // Search Video Card that can run the vulkan instance.
         // 1.3 - Enumerate available devices
         uint32_t deviceCount = 0;
@@ -424,33 +6129,200 @@ private:
         // Populate stuff.
         vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
 
-        // Loop devices and grab the first one that is lit.
+        // 50 - Rate every device instead of grabbing the first one that is lit,
+        // the first one is often the integrated or the software one.
+        std::vector<DeviceRating> ratings;
         for (const auto &device : devices)
         {
-            // Check if the device works depending on what we need.
-            if (isDeviceSuitable(device))
+            ratings.push_back(rateDevice(device));
+        }
+        std::stable_sort(ratings.begin(), ratings.end(), [](const DeviceRating &a, const DeviceRating &b)
+                         { return a.suitable != b.suitable ? a.suitable : a.score > b.score; });
+
+        for (const auto &rating : ratings)
+        {
+            std::string line = "Device '" + rating.name + "' [" + rating.uuid + "] ";
+            line += rating.suitable ? "score " + std::to_string(rating.score) : "not suitable";
+            for (const auto &reason : rating.reasons)
             {
-                physicalDevice = device;
-                break;
+                line += "\n    " + reason;
             }
+            BINI_LOG(Info, Device, line);
         }
-        if (physicalDevice == VK_NULL_HANDLE)
+
+        const DeviceRating *chosen = nullptr;
+        if (!config.deviceOverride.empty())
+        {
+            chosen = findDeviceOverride(ratings);
+            BINI_LOG(Info, Device, "Using '" + chosen->name + "', requested with --device " + config.deviceOverride);
+        }
+        else if (!ratings.empty() && ratings.front().suitable)
+        {
+            chosen = &ratings.front();
+            if (ratings.size() > 1 && ratings[1].suitable)
+            {
+                BINI_LOG(Info, Device, "Using '" + chosen->name + "', it beat '" + ratings[1].name + "' by " +
+                                       std::to_string(chosen->score - ratings[1].score) + " points");
+            }
+            else
+            {
+                BINI_LOG(Info, Device, "Using '" + chosen->name + "', the only suitable device");
+            }
+        }
+
+        if (chosen == nullptr)
         {
             throw std::runtime_error("No physical devices have the capabilities to run our program.");
         }
+        physicalDevice = chosen->device;
+    }
+
+    // The override has to match exactly one device, and that device has to be able to run us.
+    const DeviceRating *findDeviceOverride(const std::vector<DeviceRating> &ratings)
+    {
+        std::string wanted = biniutils::toLower(config.deviceOverride);
+        const DeviceRating *match = nullptr;
+        for (const auto &rating : ratings)
+        {
+            if (rating.uuid == wanted || biniutils::toLower(rating.name).find(wanted) != std::string::npos)
+            {
+                if (match != nullptr)
+                {
+                    throw std::runtime_error("--device " + config.deviceOverride + " matches more than one device.");
+                }
+                match = &rating;
+            }
+        }
+        if (match == nullptr)
+        {
+            throw std::runtime_error("--device " + config.deviceOverride + " doesn't match any device.");
+        }
+        if (!match->suitable)
+        {
+            throw std::runtime_error("Device '" + match->name + "' can't run our program.");
+        }
+        return match;
+    }
+
+    // 51 - Give each device points for what makes it faster for us. The
+    // device type dominates, the rest breaks ties between similar devices.
+    DeviceRating rateDevice(VkPhysicalDevice device)
+    {
+        DeviceRating rating;
+        rating.device = device;
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(device, &properties);
+        rating.name = properties.deviceName;
+
+        // The device UUID is only there since Vulkan 1.1, on both sides.
+        rating.uuid = "no uuid";
+        if (std::min(properties.apiVersion, instanceApiVersion) >= VK_API_VERSION_1_1)
+        {
+            VkPhysicalDeviceIDProperties idProperties{};
+            idProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+            VkPhysicalDeviceProperties2 properties2{};
+            properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+            properties2.pNext = &idProperties;
+            vkGetPhysicalDeviceProperties2(device, &properties2);
+            rating.uuid = biniutils::uuidToString(idProperties.deviceUUID);
+        }
+
+        DeviceExtensionSet available = availableDeviceExtensions(device);
+        rating.suitable = isDeviceSuitable(device, available);
+        if (!rating.suitable)
+        {
+            rating.reasons.push_back("missing a graphics/present queue, a required extension or swap chain support");
+            return rating;
+        }
+
+        auto addPoints = [&rating](uint64_t points, const std::string &reason)
+        {
+            rating.score += points;
+            rating.reasons.push_back("+" + std::to_string(points) + " " + reason);
+        };
+
+        // Device type dominates: tiers are at least 4000 apart and every other
+        // term is capped so together they stay under that (about 3700 now).
+        switch (properties.deviceType)
+        {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+            addPoints(100000, "discrete GPU");
+            break;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+            addPoints(50000, "integrated GPU");
+            break;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+            addPoints(20000, "virtual GPU");
+            break;
+        case VK_PHYSICAL_DEVICE_TYPE_CPU:
+            addPoints(1000, "CPU (software) device");
+            break;
+        default:
+            addPoints(5000, "other device type");
+            break;
+        }
+
+        // Bigger device local heap means more resources stay in fast memory.
+        // Capped, CPU devices report the whole system RAM as device local.
+        VkPhysicalDeviceMemoryProperties memProperties;
+        vkGetPhysicalDeviceMemoryProperties(device, &memProperties);
+        VkDeviceSize deviceLocalBytes = 0;
+        for (uint32_t i = 0; i < memProperties.memoryHeapCount; i++)
+        {
+            if (memProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+            {
+                deviceLocalBytes = std::max(deviceLocalBytes, memProperties.memoryHeaps[i].size);
+            }
+        }
+        addPoints(std::min<uint64_t>(deviceLocalBytes / (16 * 1024 * 1024), 1000), std::to_string(deviceLocalBytes / (1024 * 1024)) + " MiB device local heap");
+
+        // Queue layout: graphics and present together saves the concurrent
+        // sharing, separate compute / transfer families can run alongside graphics.
+        QueueFamilyIndexes indexes = findQueueFamilies(device);
+        if (indexes.presentFamily.has_value() && indexes.presentFamily == indexes.graphicsFamily)
+        {
+            addPoints(300, "graphics and present in the same family");
+        }
+        if (indexes.computeFamily.has_value())
+        {
+            addPoints(200, "dedicated compute family");
+        }
+        if (indexes.transferFamily.has_value())
+        {
+            addPoints(200, "dedicated transfer family");
+        }
+
+        // Limits, bigger images and more allocations point to more capable hardware.
+        addPoints(std::min<uint64_t>(properties.limits.maxImageDimension2D / 64, 500), "max 2D image " + std::to_string(properties.limits.maxImageDimension2D));
+        addPoints(std::min<uint64_t>(properties.limits.maxMemoryAllocationCount / 1024, 500),
+                  std::to_string(properties.limits.maxMemoryAllocationCount) + " max allocations");
+
+        // Optional extensions that give us faster paths.
+        for (uint32_t i = 0; i < static_cast<uint32_t>(DeviceExtension::Count); i++)
+        {
+            const DeviceExtensionInfo &info = deviceExtensionInfos[i];
+            if (!info.required && available.has(static_cast<DeviceExtension>(i)) && !(info.presentOnly && config.headless))
+            {
+                addPoints(100, std::string("has ") + info.name);
+            }
+        }
+
+        return rating;
     }
 
-    bool isDeviceSuitable(VkPhysicalDevice device)
+    bool isDeviceSuitable(VkPhysicalDevice device, const DeviceExtensionSet &available)
     {
         // Once the struct is defined we can modify it.
         QueueFamilyIndexes indices = findQueueFamilies(device);
 
         // 21 - Check for support for all of our extensions.
-        bool extensionsSupported = checkDeviceExtensionSupport(device);
+        bool extensionsSupported = available.containsAll(requiredDeviceExtensions());
 
         // 27 - Check support for swapchains
-        bool swapChainAdequate = false;
-        if (extensionsSupported)
+        // Nothing to check without a surface.
+        bool swapChainAdequate = config.headless;
+        if (extensionsSupported && !config.headless)
         {
             SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
             swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
@@ -459,7 +6331,23 @@ private:
         return indices.isComplete() && extensionsSupported && swapChainAdequate;
     }
 
-    bool checkDeviceExtensionSupport(VkPhysicalDevice device)
+    // The required tier. The swap chain extension is only needed when we present to a surface.
+    DeviceExtensionSet requiredDeviceExtensions()
+    {
+        DeviceExtensionSet required;
+        for (uint32_t i = 0; i < static_cast<uint32_t>(DeviceExtension::Count); i++)
+        {
+            const DeviceExtensionInfo &info = deviceExtensionInfos[i];
+            if (info.required && !(info.presentOnly && config.headless))
+            {
+                required.add(static_cast<DeviceExtension>(i));
+            }
+        }
+        return required;
+    }
+
+    // Which of our extensions the device has, one pass over its list.
+    DeviceExtensionSet availableDeviceExtensions(VkPhysicalDevice device)
     {
         uint32_t extensionCount;
         vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
@@ -467,15 +6355,20 @@ private:
         std::vector<VkExtensionProperties> availableExtensions(extensionCount);
         vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
 
-        std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
-
         // iterate through the extensions found on the physical device.
+        DeviceExtensionSet available;
         for (const auto &extension : availableExtensions)
         {
-            requiredExtensions.erase(extension.extensionName);
+            for (uint32_t i = 0; i < static_cast<uint32_t>(DeviceExtension::Count); i++)
+            {
+                if (strcmp(extension.extensionName, deviceExtensionInfos[i].name) == 0)
+                {
+                    available.add(static_cast<DeviceExtension>(i));
+                    break;
+                }
+            }
         }
-
-        return requiredExtensions.empty();
+        return available;
     }
 
     // 1.5 - Queues
@@ -485,31 +6378,45 @@ private:
     QueueFamilyIndexes findQueueFamilies(VkPhysicalDevice device)
     {
         QueueFamilyIndexes indexes;
+        indexes.presentRequired = surface != VK_NULL_HANDLE;
         uint32_t queueFamilyCount = 0;
 
         vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, nullptr);
         std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
         vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, queueFamilies.data());
 
-        int i = 0;
+        // We go through every family, the dedicated ones are usually the last.
+        uint32_t i = 0;
         for (const auto &queueFamily : queueFamilies)
         {
-            if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+            bool graphics = queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT;
+            bool compute = queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT;
+            bool transfer = queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT;
+
+            if (graphics && !indexes.graphicsFamily.has_value())
             {
                 indexes.graphicsFamily = i;
             }
 
             // 19 - Check for the presentation queue family
             VkBool32 presentSupport = false;
-            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
-            if (presentSupport)
+            if (indexes.presentRequired)
+            {
+                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+            }
+            // Prefer presenting from the graphics family, it avoids sharing the images.
+            if (presentSupport && (!indexes.presentFamily.has_value() || i == indexes.graphicsFamily))
             {
                 indexes.presentFamily = i;
             }
 
-            if (indexes.isComplete())
+            if (compute && !graphics && !indexes.computeFamily.has_value())
             {
-                break;
+                indexes.computeFamily = i;
+            }
+            if (transfer && !graphics && !compute && !indexes.transferFamily.has_value())
+            {
+                indexes.transferFamily = i;
             }
             i++;
         }
@@ -518,6 +6425,7 @@ private:
 
     void createVulkanInstance()
     {
+        CPU_ZONE("createVulkanInstance");
         // Vulkan common paradigm
         // Struct with values to create an instance of something.
         VkApplicationInfo info{};
@@ -527,33 +6435,127 @@ private:
         info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
         info.pEngineName = "None";
         info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-        info.apiVersion = VK_API_VERSION_1_0;
+        // 97 - Ask for the highest version the loader supports, capped to the
+        // newest one we know how to use. A 1.0 loader fails instance creation
+        // for anything above 1.0 and doesn't even have vkEnumerateInstanceVersion.
+        instanceApiVersion = VK_API_VERSION_1_0;
+        auto enumerateInstanceVersion = reinterpret_cast<PFN_vkEnumerateInstanceVersion>(
+            vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion"));
+        if (enumerateInstanceVersion != nullptr && enumerateInstanceVersion(&instanceApiVersion) != VK_SUCCESS)
+        {
+            instanceApiVersion = VK_API_VERSION_1_0;
+        }
+        instanceApiVersion = std::min(instanceApiVersion, VK_API_VERSION_1_3);
+        info.apiVersion = instanceApiVersion;
+        BINI_LOG(Info, Device, "Instance API version " + std::to_string(VK_API_VERSION_MAJOR(instanceApiVersion)) + "." +
+                               std::to_string(VK_API_VERSION_MINOR(instanceApiVersion)));
 
         // Variables needed to get extensions.
         // We want that the instance of the Vulkan app can interact with GLFW.
         // Extensions - Funcionalidad modularizada
         uint32_t glfwExtensionCount = 0;
-        const char **glfwExtensions;
+        const char **glfwExtensions = nullptr;
+
+        // Headless we never talk to a window system, so no extensions needed.
+        if (!config.headless)
+        {
+            glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        }
 
-        glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        std::vector<const char *> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
 
         VkInstanceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
         createInfo.pApplicationInfo = &info;
-        createInfo.enabledExtensionCount = glfwExtensionCount;
-        createInfo.ppEnabledExtensionNames = glfwExtensions;
-        // Add to instance validation layers.
-        if (enableValidationLayers)
+
+        // 94 - Validation is decided at runtime. With it we also want the
+        // messages (debug utils, chained here to also hear about instance
+        // creation) and the optional extra checks of validation features.
+        VkDebugUtilsMessengerCreateInfoEXT messengerInfo{};
+        VkValidationFeaturesEXT validationFeatures{};
+        std::vector<VkValidationFeatureEnableEXT> enabledFeatures;
+        if (config.validation)
         {
             createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
             createInfo.ppEnabledLayerNames = validationLayers.data();
+
+            validationMessenger.configure(config.validationSeverity, config.validationIgnore);
+            messengerInfo = validationMessenger.createInfo();
+            extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+            createInfo.pNext = &messengerInfo;
+
+            enabledFeatures = validationFeatureList();
+            if (!enabledFeatures.empty())
+            {
+                if (layerHasExtension(validationLayers[0], VK_EXT_VALIDATION_FEATURES_EXTENSION_NAME))
+                {
+                    validationFeatures.sType = VK_STRUCTURE_TYPE_VALIDATION_FEATURES_EXT;
+                    validationFeatures.enabledValidationFeatureCount = static_cast<uint32_t>(enabledFeatures.size());
+                    validationFeatures.pEnabledValidationFeatures = enabledFeatures.data();
+                    validationFeatures.pNext = createInfo.pNext;
+                    createInfo.pNext = &validationFeatures;
+                    extensions.push_back(VK_EXT_VALIDATION_FEATURES_EXTENSION_NAME);
+                }
+                else
+                {
+                    BINI_LOG(Warning, Validation, "The validation layer has no VK_EXT_validation_features, the extra checks are off.");
+                }
+            }
         }
         else
         {
             createInfo.enabledLayerCount = 0;
         }
-        // Optional use the object result to verify results.
+        createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+        createInfo.ppEnabledExtensionNames = extensions.data();
+        // Debug utils and validation features are extra ways for this to fail.
         VkResult result = vkCreateInstance(&createInfo, NULL, &instance);
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create instance! (VkResult " + std::to_string(result) + ")");
+        }
+    }
+
+    std::vector<VkValidationFeatureEnableEXT> validationFeatureList()
+    {
+        std::vector<VkValidationFeatureEnableEXT> features;
+        for (const auto &name : config.validationFeatures)
+        {
+            if (name == "best-practices")
+            {
+                features.push_back(VK_VALIDATION_FEATURE_ENABLE_BEST_PRACTICES_EXT);
+            }
+            else if (name == "sync")
+            {
+                features.push_back(VK_VALIDATION_FEATURE_ENABLE_SYNCHRONIZATION_VALIDATION_EXT);
+            }
+            else if (name == "gpu-assisted")
+            {
+                features.push_back(VK_VALIDATION_FEATURE_ENABLE_GPU_ASSISTED_EXT);
+            }
+            else if (name == "debug-printf")
+            {
+                features.push_back(VK_VALIDATION_FEATURE_ENABLE_DEBUG_PRINTF_EXT);
+            }
+        }
+        return features;
+    }
+
+    // Instance extensions provided by a layer.
+    bool layerHasExtension(const char *layer, const char *extension)
+    {
+        uint32_t count = 0;
+        vkEnumerateInstanceExtensionProperties(layer, &count, nullptr);
+        std::vector<VkExtensionProperties> extensions(count);
+        vkEnumerateInstanceExtensionProperties(layer, &count, extensions.data());
+        for (const auto &properties : extensions)
+        {
+            if (strcmp(properties.extensionName, extension) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
     }
 
     bool checkValidationLayerSupport()
@@ -592,10 +6594,73 @@ private:
 
     void mainLoop()
     {
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+        auto lastReport = start;
+        uint64_t lastReportFrames = 0;
+
         // Create GLFW loop.
-        while (!glfwWindowShouldClose(window))
+        // Headless there is no window to close, --max-frames ends the run.
+        while (config.headless || !glfwWindowShouldClose(window))
+        {
+            if (!config.headless)
+            {
+                CPU_ZONE("poll events");
+                glfwPollEvents();
+            }
+            drawFrame();
+
+            if (config.maxFrames > 0 && frameCount >= config.maxFrames)
+            {
+                break;
+            }
+
+            // Report frames per second once every second.
+            auto now = clock::now();
+            double elapsed = std::chrono::duration<double>(now - lastReport).count();
+            if (elapsed >= 1.0)
+            {
+                double fps = static_cast<double>(frameCount - lastReportFrames) / elapsed;
+                if (renderGraph.transientMemoryWithoutAliasing() > 0)
+                {
+                    BINI_LOGF(Info, General, "FPS: %f (%f ms/frame), transient memory %llu KiB (%llu KiB without aliasing)", fps, 1000.0 / fps,
+                              static_cast<unsigned long long>(renderGraph.transientMemory() / 1024),
+                              static_cast<unsigned long long>(renderGraph.transientMemoryWithoutAliasing() / 1024));
+                }
+                else
+                {
+                    BINI_LOGF(Info, General, "FPS: %f (%f ms/frame)", fps, 1000.0 / fps);
+                }
+
+                // Overlay of the GPU timings, the title is all we have to draw text.
+                if (gpuProfiler.enabled())
+                {
+                    std::string gpuTimes = "GPU: " + gpuProfiler.summary(4);
+                    if (config.headless)
+                    {
+                        BINI_LOG(Info, Profiler, gpuTimes);
+                    }
+                    else
+                    {
+                        char fpsText[32];
+                        std::snprintf(fpsText, sizeof(fpsText), "%.1f FPS", fps);
+                        glfwSetWindowTitle(window, ("Test Window | " + std::string(fpsText) + " | " + gpuTimes).c_str());
+                    }
+                }
+                lastReport = now;
+                lastReportFrames = frameCount;
+            }
+        }
+
+        // Nothing can be destroyed while the GPU is still using it.
+        vkDeviceWaitIdle(device);
+
+        double total = std::chrono::duration<double>(clock::now() - start).count();
+        if (total > 0.0)
         {
-            glfwPollEvents();
+            biniutils::logstdout("Rendered " + std::to_string(frameCount) + " frames with " +
+                                 std::to_string(config.framesInFlight) + " frames in flight, average FPS: " +
+                                 std::to_string(static_cast<double>(frameCount) / total));
         }
     }
 
@@ -604,16 +6669,68 @@ private:
     // Destructor is normally used to free internal pointers, is good practice.
     void cleanup()
     {
+        CPU_ZONE("cleanup");
         // very important - we DON'T have a garbage collector so we need to clean up
         // Clean GFLW
         biniutils::logstdout("Cleaning up application.");
 
-        glfwDestroyWindow(window);
-        glfwTerminate();
+        // 46 - Frame slots and the semaphores of the swap chain images.
+        for (auto &frame : frames)
+        {
+            vkDestroySemaphore(device, frame.imageAvailable, nullptr);
+            vkDestroySemaphore(device, frame.uploadsDone, nullptr);
+            // Destroying the pool frees its command buffers too.
+            vkDestroyCommandPool(device, frame.commandPool, nullptr);
+        }
+        for (auto semaphore : renderFinishedSemaphores)
+        {
+            vkDestroySemaphore(device, semaphore, nullptr);
+        }
+        deletionQueue.flush();
+
+        // Views before their images, framebuffers before the views.
+        destroySwapChainImageViews(swapChainImageViews);
+        destroySwapChainImageViews(swapChainAlternateViews);
+        renderingPath.cleanup();
 
         // 34 - Clean before device.
         vkDestroySwapchainKHR(device, swapChain, nullptr);
 
+        // Headless the images are ours, so we have to free them too.
+        if (config.headless)
+        {
+            for (size_t i = 0; i < swapChainImages.size(); i++)
+            {
+                vkDestroyImage(device, swapChainImages[i], nullptr);
+                memoryAllocator.free(offscreenImageMemory[i]);
+            }
+        }
+
+        savePipelineCache();
+        vkDestroyPipelineCache(device, pipelineCache, nullptr);
+
+        renderGraph.reset();
+        recorder.cleanup();
+
+        if (!config.gpuProfilePath.empty())
+        {
+            // The device is idle, so the last frames can be read too.
+            for (uint32_t slot = 0; slot < config.framesInFlight; slot++)
+            {
+                gpuProfiler.collect(slot);
+            }
+            gpuProfiler.dump(config.gpuProfilePath);
+        }
+        gpuProfiler.cleanup();
+        vkDestroyPipelineLayout(device, scenePipelineLayout, nullptr);
+
+        stagingRing.cleanup();
+        gpuTimeline.cleanup();
+
+        // Everything allocated from it is gone by now.
+        memoryAllocator.logStats();
+        memoryAllocator.cleanup();
+
         // 1.10 - Destroy the logical device.
         vkDestroyDevice(device, nullptr);
 
@@ -622,22 +6739,37 @@ private:
         vkDestroySurfaceKHR(instance, surface, nullptr);
 
         // Clean Vulkan
+        if (config.validation)
+        {
+            validationMessenger.destroy(instance);
+        }
         vkDestroyInstance(instance, nullptr);
+
+        // The window goes last, the surface was still pointing to it.
+        if (!config.headless)
+        {
+            glfwDestroyWindow(window);
+            glfwTerminate();
+        }
     }
 };
 
-int main()
+int main(int argc, char **argv)
 {
-    FirstVulkanExample app;
-
     try
     {
+        AppConfig config = parseArguments(argc, argv);
+        biniutils::Logger::instance().setLevel(config.logLevel);
+        FirstVulkanExample app(config);
+
         biniutils::logstdout("Initializing application.");
         app.run();
+        biniutils::Logger::instance().flush();
     }
     catch (const std::exception &e)
     {
-        // Salida para errores
+        // Salida para errores, after whatever was logged before it.
+        biniutils::Logger::instance().flush();
         std::cerr << e.what() << std::endl;
         return EXIT_FAILURE;
     }